@@ -194,6 +194,19 @@ cmn_usec_now(void)
     return usec;
 }
 
+/*
+ * Return the monotonic time in microseconds, for measuring intervals
+ */
+int64_t
+cmn_usec_mono(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t)now.tv_sec * 1000000LL + (int64_t)now.tv_nsec / 1000;
+}
+
 
 void *
 cmn_mmap(size_t size, const char *name, int line)
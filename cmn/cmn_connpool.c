@@ -0,0 +1,281 @@
+#include "cmn_base.h"
+#include "cmn_log.h"
+#include "cmn_connpool.h"
+
+/* c first, the sock_conn handed out is the connpool_conn */
+struct connpool_conn {
+    struct sock_conn          c;
+    TAILQ_ENTRY(connpool_conn) link;    /* idle or connecting list link */
+    struct connpool           *pool;
+    int64_t                   idle_since;/* ms the connection went idle */
+    connpool_fn               cb;       /* pending get */
+    void                      *arg;
+};
+
+static inline int64_t
+_connpool_now(void)
+{
+    return cmn_usec_mono() / 1000;
+}
+
+static void
+_connpool_close(struct connpool_conn *pc)
+{
+    if (pc->c.sd >= 0) {
+        close(pc->c.sd);
+    }
+    if (pc->c.oq != NULL) {
+        cmn_free(pc->c.oq);
+    }
+    cmn_free(pc);
+}
+
+/*
+ * an idle connection must have nothing to read: eof means the peer closed
+ * it, data is a stray reply that would be taken for the next response
+ */
+static bool
+_connpool_alive(struct connpool_conn *pc)
+{
+    char byte;
+    ssize_t n;
+
+    n = recv(pc->c.sd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+    }
+
+    log_debug("idle connection sd %d is dead: %s", pc->c.sd,
+              n < 0 ? strerror(errno) : n == 0 ? "eof" : "unexpected data");
+
+    return false;
+}
+
+static void
+_connpool_reap(void *arg)
+{
+    struct connpool *pool = arg;
+    struct connpool_conn *pc;
+    int64_t now = _connpool_now();
+
+    if (pool->conf.idle_timeout <= 0) {
+        return;
+    }
+
+    /* the least recently used connections are at the tail */
+    while ((pc = TAILQ_LAST(&pool->idle, connpool_list)) != NULL) {
+        if (now - pc->idle_since < pool->conf.idle_timeout) {
+            break;
+        }
+
+        TAILQ_REMOVE(&pool->idle, pc, link);
+        pool->nidle--;
+        _connpool_close(pc);
+    }
+
+    pc = TAILQ_LAST(&pool->idle, connpool_list);
+    if (pc != NULL) {
+        event_timer_add(pool->evb, &pool->reap,
+                        pc->idle_since + pool->conf.idle_timeout - now);
+    }
+}
+
+struct connpool *
+connpool_create(struct event_base *evb, struct addrinfo *ai,
+                const struct connpool_conf *conf)
+{
+    struct connpool *pool;
+
+    ASSERT(evb != NULL && ai != NULL && conf != NULL);
+
+    if (ai->ai_addrlen > sizeof(pool->addr)) {
+        log_error("connection pool address of length %u too long", ai->ai_addrlen);
+        return NULL;
+    }
+
+    pool = (struct connpool *)cmn_zalloc(sizeof(*pool));
+    if (pool == NULL) {
+        log_error("connection pool creation failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    pool->evb = evb;
+    memcpy(&pool->addr, ai->ai_addr, ai->ai_addrlen);
+    pool->addrlen = ai->ai_addrlen;
+    pool->family = ai->ai_family;
+    pool->conf = *conf;
+    pool->conf.max_idle = MAX(pool->conf.max_idle, 0);
+    pool->conf.max_active = MAX(pool->conf.max_active, 1);
+    if (pool->conf.backoff_max > 0) {
+        /* a back-off of 0 would never double */
+        pool->conf.backoff_min = MAX(pool->conf.backoff_min, 1);
+        pool->conf.backoff_max = MAX(pool->conf.backoff_max, pool->conf.backoff_min);
+    } else {
+        pool->conf.backoff_min = pool->conf.backoff_max = 0;
+    }
+    TAILQ_INIT(&pool->idle);
+    TAILQ_INIT(&pool->connecting);
+    pool->nidle = 0;
+    pool->nactive = 0;
+    pool->backoff = 0;
+    pool->retry_at = 0;
+    timer_init(&pool->reap, _connpool_reap, pool);
+
+    return pool;
+}
+
+void
+connpool_destroy(struct connpool **pool)
+{
+    struct connpool *p = *pool;
+    struct connpool_conn *pc;
+
+    if (p == NULL) {
+        return;
+    }
+
+    event_timer_del(p->evb, &p->reap);
+
+    /* their callbacks never run */
+    while ((pc = TAILQ_FIRST(&p->connecting)) != NULL) {
+        TAILQ_REMOVE(&p->connecting, pc, link);
+        sock_connect_cancel(&pc->c);
+        _connpool_close(pc);
+        p->nactive--;
+    }
+
+    if (p->nactive > 0) {
+        log_warn("destroy connection pool %p with %d connections in use", p, p->nactive);
+    }
+
+    while ((pc = TAILQ_FIRST(&p->idle)) != NULL) {
+        TAILQ_REMOVE(&p->idle, pc, link);
+        _connpool_close(pc);
+    }
+
+    cmn_free(p);
+    *pool = NULL;
+}
+
+static void
+_connpool_failed(struct connpool *pool, int err)
+{
+    pool->nfail++;
+    pool->backoff = pool->backoff == 0 ? pool->conf.backoff_min :
+                    MIN(pool->backoff * 2, pool->conf.backoff_max);
+    pool->retry_at = _connpool_now() + pool->backoff;
+    log_warn("connection pool %p connect failed: %s, back off %lld ms", pool,
+             strerror(err), (long long)pool->backoff);
+}
+
+static void
+_connpool_connected(struct sock_conn *c, int err, void *arg)
+{
+    struct connpool_conn *pc = arg;
+    struct connpool *pool = pc->pool;
+    connpool_fn cb = pc->cb;
+
+    arg = pc->arg;
+    TAILQ_REMOVE(&pool->connecting, pc, link);
+
+    if (err != 0) {
+        pool->nactive--;
+        _connpool_failed(pool, err);
+        _connpool_close(pc);
+        cb(NULL, err, arg);
+        return;
+    }
+
+    pool->backoff = 0;
+    cb(c, 0, arg);
+}
+
+int
+connpool_get(struct connpool *pool, connpool_fn cb, void *arg)
+{
+    struct connpool_conn *pc;
+    struct addrinfo ai;
+    int64_t now = _connpool_now();
+
+    ASSERT(pool != NULL && cb != NULL);
+
+    while ((pc = TAILQ_FIRST(&pool->idle)) != NULL) {
+        TAILQ_REMOVE(&pool->idle, pc, link);
+        pool->nidle--;
+
+        if ((pool->conf.idle_timeout > 0 && now - pc->idle_since >= pool->conf.idle_timeout) ||
+            !_connpool_alive(pc)) {
+            _connpool_close(pc);
+            continue;
+        }
+
+        pool->nactive++;
+        pool->nreuse++;
+        cb(&pc->c, 0, arg);
+        return CMN_OK;
+    }
+
+    if (pool->nactive >= pool->conf.max_active) {
+        return CMN_EAGAIN;
+    }
+
+    if (now < pool->retry_at) {
+        log_debug("connection pool %p backing off for %lld ms", pool,
+                  (long long)(pool->retry_at - now));
+        return CMN_ERROR;
+    }
+
+    pc = (struct connpool_conn *)cmn_zalloc(sizeof(*pc));
+    if (pc == NULL) {
+        log_error("pooled connection creation failed: %s", strerror(errno));
+        return CMN_ERROR;
+    }
+
+    pc->c.sd = -1;
+    pc->pool = pool;
+    pc->cb = cb;
+    pc->arg = arg;
+
+    memset(&ai, 0, sizeof(ai));
+    ai.ai_family = pool->family;
+    ai.ai_socktype = SOCK_STREAM;
+    ai.ai_addr = (struct sockaddr *)&pool->addr;
+    ai.ai_addrlen = pool->addrlen;
+
+    if (sock_connect_async(pool->evb, &ai, &pc->c, pool->conf.profile,
+                           pool->conf.connect_timeout, _connpool_connected, pc) != CMN_OK) {
+        _connpool_failed(pool, pc->c.err);
+        cmn_free(pc);
+        return CMN_ERROR;
+    }
+
+    TAILQ_INSERT_TAIL(&pool->connecting, pc, link);
+
+    pool->nactive++;
+    pool->nconnect++;
+
+    return CMN_OK;
+}
+
+void
+connpool_put(struct connpool *pool, struct sock_conn *c, bool is_reusable)
+{
+    struct connpool_conn *pc = (struct connpool_conn *)c;
+
+    ASSERT(pool != NULL && pc->pool == pool);
+
+    pool->nactive--;
+
+    if (!is_reusable || c->err != 0 || c->noq > 0 || pool->nidle >= pool->conf.max_idle) {
+        _connpool_close(pc);
+        return;
+    }
+
+    pc->idle_since = _connpool_now();
+    TAILQ_INSERT_HEAD(&pool->idle, pc, link);
+    pool->nidle++;
+
+    if (pool->conf.idle_timeout > 0 && !timer_pending(&pool->reap)) {
+        event_timer_add(pool->evb, &pool->reap, pool->conf.idle_timeout);
+    }
+}
@@ -1,6 +1,41 @@
 #include "cmn_log.h"
 #include "cmn_base.h"
 #include "cmn_daemon.h"
+#include "cmn_event.h"
+
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#define DAEMON_WAIT_FAIL    16      /* failed waits in a row before the master gives up */
+#define DAEMON_STOP_WAIT    5000    /* ms workers get to exit before SIGKILL */
+
+struct daemon_master;
+
+/* master private state of a worker */
+struct daemon_respawn {
+    struct timer         timer;     /* delayed respawn */
+    struct daemon_master *m;
+    int                  id;
+    int64_t              started;   /* ms (monotonic) of the last start */
+    int64_t              backoff;   /* ms of the current back-off, 0 if none */
+};
+
+struct daemon_master {
+    struct event_base          *evb;
+    struct daemon_prefork_conf conf;
+    daemon_worker_fn           fn;
+    void                       *arg;
+    struct daemon_respawn      *r;
+    int                        ncpu;
+    int                        nalive;      /* # workers running */
+    bool                       is_stop;
+    struct timer               report;
+};
+
+static struct daemon_worker *workers;       /* shared slots */
+static int nworkers;
+static struct daemon_worker *worker_self;   /* slot of this worker */
 
 int
 daemon_init(bool is_open, char *dir)
@@ -48,3 +83,419 @@ daemon_init(bool is_open, char *dir)
 
     return (CMN_OK);
 }
+
+static void
+_daemon_signal(void *arg, int signo)
+{
+    switch (signo) {
+        case SIGHUP:
+            log_reopen();
+            break;
+        case SIGTTIN:
+            log_level_up();
+            break;
+        case SIGTTOU:
+            log_level_down();
+            break;
+        default:
+            break;
+    }
+
+    log_info("signal %d (%s) handled", signo, strsignal(signo));
+}
+
+int
+daemon_signal_init(struct event_base *evb)
+{
+    static const int signos[] = { SIGHUP, SIGTTIN, SIGTTOU };
+    size_t i;
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        log_error("ignore SIGPIPE failed: %s", strerror(errno));
+        return (CMN_ERROR);
+    }
+
+    for (i = 0; i < NELEM(signos); i++) {
+        if (event_signal_add(evb, signos[i], _daemon_signal, NULL) != CMN_OK) {
+            return (CMN_ERROR);
+        }
+    }
+
+    return (CMN_OK);
+}
+
+static inline int64_t
+_daemon_now(void)
+{
+    return cmn_usec_mono() / 1000;
+}
+
+static void
+_daemon_worker_run(struct daemon_master *m, int id, pid_t ppid)
+{
+    struct daemon_worker *w = &workers[id];
+    static const int signos[] = { SIGHUP, SIGTTIN, SIGTTOU };
+    cpu_set_t set;
+    size_t n;
+    int i;
+
+    /*
+     * the master forwards these, ignore them until the worker opts in with
+     * daemon_signal_init, else a log rotation would kill every worker
+     */
+    for (n = 0; n < NELEM(signos); n++) {
+        signal(signos[n], SIG_IGN);
+    }
+
+    /* drops the signalfd and unblocks the signals of the master */
+    event_timer_del(m->evb, &m->report);
+    for (i = 0; i < nworkers; i++) {
+        event_timer_del(m->evb, &m->r[i].timer);
+    }
+    event_base_destroy(&m->evb);
+
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != ppid) {
+        _exit(EXIT_FAILURE);
+    }
+
+    if (log_async_child() != CMN_OK) {
+        log_warn("restart of the log writer in worker %d failed, log synchronously", id);
+    }
+
+    w->cpu = -1;
+    if (m->conf.is_pin) {
+        CPU_ZERO(&set);
+        CPU_SET(id % m->ncpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            log_warn("pin worker %d to cpu %d failed, ignored: %s", id, id % m->ncpu,
+                     strerror(errno));
+        } else {
+            w->cpu = id % m->ncpu;
+        }
+    }
+
+    worker_self = w;
+    w->pid = getpid();
+    w->heartbeat = _daemon_now();
+
+    exit(m->fn(id, m->arg));
+}
+
+static int
+_daemon_spawn(struct daemon_master *m, int id)
+{
+    struct daemon_worker *w = &workers[id];
+    pid_t pid, ppid = getpid();
+
+    pid = fork();
+    if (pid < 0) {
+        log_error("fork of worker %d failed: %s", id, strerror(errno));
+        return (CMN_ERROR);
+    }
+
+    if (pid == 0) {
+        _daemon_worker_run(m, id, ppid);
+    }
+
+    /* set here too, so the master never misses the exit of pid */
+    w->pid = pid;
+    w->heartbeat = _daemon_now();
+    w->nspawn++;
+    m->r[id].started = _daemon_now();
+    m->nalive++;
+
+    log_info("worker %d started as pid %d", id, pid);
+
+    return (CMN_OK);
+}
+
+static void
+_daemon_respawn(void *arg)
+{
+    struct daemon_respawn *r = arg;
+    struct daemon_master *m = r->m;
+
+    if (m->is_stop) {
+        return;
+    }
+
+    if (_daemon_spawn(m, r->id) != CMN_OK) {
+        r->backoff = MAX(r->backoff, MAX(m->conf.backoff_min, 1));
+        event_timer_add(m->evb, &r->timer, r->backoff);
+    }
+}
+
+static void
+_daemon_reap(struct daemon_master *m)
+{
+    struct daemon_respawn *r;
+    pid_t pid;
+    int status, id;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (id = 0; id < nworkers && workers[id].pid != pid; id++);
+        if (id == nworkers) {
+            continue;
+        }
+
+        workers[id].pid = 0;
+        m->nalive--;
+        r = &m->r[id];
+
+        if (WIFSIGNALED(status) && !(m->is_stop && WTERMSIG(status) == SIGTERM)) {
+            log_warn("worker %d pid %d killed by signal %d (%s)", id, pid,
+                     WTERMSIG(status), strsignal(WTERMSIG(status)));
+        } else if (WEXITSTATUS(status) != EXIT_SUCCESS || !m->is_stop) {
+            log_warn("worker %d pid %d exited with status %d", id, pid,
+                     WEXITSTATUS(status));
+        }
+
+        if (m->is_stop) {
+            continue;
+        }
+
+        /* a worker dying soon after its start would otherwise spin fork */
+        if (_daemon_now() - r->started >= m->conf.stable) {
+            r->backoff = 0;
+        } else {
+            r->backoff = r->backoff == 0 ? MAX(m->conf.backoff_min, 1) :
+                         MIN(r->backoff * 2, MAX(m->conf.backoff_max, 1));
+        }
+
+        if (r->backoff > 0) {
+            log_warn("respawn of worker %d backs off %lld ms", id, (long long)r->backoff);
+            event_timer_add(m->evb, &r->timer, r->backoff);
+        } else {
+            _daemon_respawn(r);
+        }
+    }
+}
+
+static void
+_daemon_master_signal(void *arg, int signo)
+{
+    struct daemon_master *m = arg;
+    int id;
+
+    switch (signo) {
+        case SIGCHLD:
+            _daemon_reap(m);
+            return;
+        case SIGHUP:
+            log_reopen();
+            break;
+        case SIGTTIN:
+            log_level_up();
+            break;
+        case SIGTTOU:
+            log_level_down();
+            break;
+        case SIGTERM:
+        case SIGINT:
+            m->is_stop = true;
+            for (id = 0; id < nworkers; id++) {
+                event_timer_del(m->evb, &m->r[id].timer);
+            }
+            signo = SIGTERM;
+            break;
+        default:
+            break;
+    }
+
+    log_info("signal %d (%s) forwarded to %d workers", signo, strsignal(signo),
+             m->nalive);
+
+    for (id = 0; id < nworkers; id++) {
+        if (workers[id].pid > 0) {
+            kill(workers[id].pid, signo);
+        }
+    }
+}
+
+static void
+_daemon_report(void *arg)
+{
+    struct daemon_master *m = arg;
+    struct daemon_worker *w;
+    int64_t now = _daemon_now(), age;
+    int id;
+
+    for (id = 0; id < nworkers; id++) {
+        w = &workers[id];
+        if (w->pid == 0) {
+            log_info("worker %d down, started %u times", id, w->nspawn);
+            continue;
+        }
+
+        age = now - w->heartbeat;
+        if (m->conf.hang > 0 && age > m->conf.hang) {
+            log_warn("worker %d pid %d silent for %lld ms", id, w->pid, (long long)age);
+        }
+
+        log_info("worker %d pid %d cpu %d load %llu requests %llu started %u times "
+                 "heartbeat %lld ms ago", id, w->pid, w->cpu,
+                 (unsigned long long)w->load, (unsigned long long)w->nrequest,
+                 w->nspawn, (long long)age);
+    }
+
+    event_timer_add(m->evb, &m->report, m->conf.report);
+}
+
+/* stop the workers without the event loop, killing those that linger */
+static void
+_daemon_master_stop(struct daemon_master *m)
+{
+    int64_t deadline;
+    int id, signo = SIGTERM;
+
+    m->is_stop = true;
+    deadline = _daemon_now() + DAEMON_STOP_WAIT;
+
+    while (m->nalive > 0) {
+        for (id = 0; id < nworkers; id++) {
+            if (workers[id].pid > 0 && signo != 0) {
+                kill(workers[id].pid, signo);
+            }
+        }
+        signo = 0;
+
+        usleep(10000);
+        _daemon_reap(m);
+
+        if (m->nalive > 0 && _daemon_now() >= deadline) {
+            log_warn("%d workers did not stop in %d ms, killed", m->nalive,
+                     DAEMON_STOP_WAIT);
+            signo = SIGKILL;
+            deadline = INT64_MAX;
+        }
+    }
+}
+
+int
+daemon_prefork(const struct daemon_prefork_conf *conf, daemon_worker_fn fn, void *arg)
+{
+    static const int signos[] = { SIGCHLD, SIGHUP, SIGTERM, SIGINT, SIGTTIN, SIGTTOU };
+    struct daemon_master m;
+    size_t size, i;
+    int id, nfail, status = CMN_ERROR;
+
+    ASSERT(conf != NULL && fn != NULL);
+    ASSERT(workers == NULL);
+
+    memset(&m, 0, sizeof(m));
+    m.conf = *conf;
+    m.fn = fn;
+    m.arg = arg;
+    m.ncpu = MAX((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+    nworkers = conf->nworker > 0 ? conf->nworker : m.ncpu;
+    if (nworkers > DAEMON_MAX_WORKER) {
+        log_error("prefork of %d workers failed: at most %d", nworkers, DAEMON_MAX_WORKER);
+        return (CMN_ERROR);
+    }
+
+    /* anonymous and shared, so every worker forked later sees it */
+    size = sizeof(struct daemon_worker) * (size_t)nworkers;
+    workers = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (workers == MAP_FAILED) {
+        log_error("map of %zu bytes worker segment failed: %s", size, strerror(errno));
+        workers = NULL;
+        return (CMN_ERROR);
+    }
+    memset(workers, 0, size);
+
+    m.r = (struct daemon_respawn *)cmn_zalloc(sizeof(*m.r) * (size_t)nworkers);
+    m.evb = event_base_create(64, NULL);
+    if (m.r == NULL || m.evb == NULL) {
+        goto done;
+    }
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        log_error("ignore SIGPIPE failed: %s", strerror(errno));
+        goto done;
+    }
+
+    for (i = 0; i < NELEM(signos); i++) {
+        if (event_signal_add(m.evb, signos[i], _daemon_master_signal, &m) != CMN_OK) {
+            goto done;
+        }
+    }
+
+    for (id = 0; id < nworkers; id++) {
+        m.r[id].m = &m;
+        m.r[id].id = id;
+        timer_init(&m.r[id].timer, _daemon_respawn, &m.r[id]);
+        workers[id].cpu = -1;
+    }
+
+    timer_init(&m.report, _daemon_report, &m);
+    if (conf->report > 0) {
+        event_timer_add(m.evb, &m.report, conf->report);
+    }
+
+    for (id = 0; id < nworkers; id++) {
+        _daemon_respawn(&m.r[id]);
+    }
+
+    log_info("master pid %d runs %d workers", getpid(), nworkers);
+
+    nfail = 0;
+    while (!m.is_stop || m.nalive > 0) {
+        if (event_wait(m.evb, -1) >= 0) {
+            nfail = 0;
+            continue;
+        }
+
+        /* a broken loop must not spin, back off and give up at last */
+        if (++nfail >= DAEMON_WAIT_FAIL) {
+            log_error("master pid %d event loop failed %d times, stop", getpid(), nfail);
+            _daemon_master_stop(&m);
+            goto done;
+        }
+        usleep((useconds_t)nfail * 100000);
+    }
+
+    log_info("master pid %d stopped", getpid());
+    status = CMN_OK;
+
+done:
+    if (m.evb != NULL) {
+        event_timer_del(m.evb, &m.report);
+        for (id = 0; m.r != NULL && id < nworkers; id++) {
+            event_timer_del(m.evb, &m.r[id].timer);
+        }
+        event_base_destroy(&m.evb);
+    }
+    if (m.r != NULL) {
+        cmn_free(m.r);
+    }
+    munmap(workers, size);
+    workers = NULL;
+    nworkers = 0;
+
+    return status;
+}
+
+void
+daemon_worker_report(uint64_t load, uint64_t nrequest)
+{
+    struct daemon_worker *w = worker_self;
+
+    if (w == NULL) {
+        return;
+    }
+
+    w->load = load;
+    w->nrequest = nrequest;
+    w->heartbeat = _daemon_now();
+}
+
+struct daemon_worker *
+daemon_workers(int *nworker)
+{
+    if (nworker != NULL) {
+        *nworker = nworkers;
+    }
+
+    return workers;
+}
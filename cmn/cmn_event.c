@@ -1,6 +1,11 @@
 #include "cmn_base.h"
 #include "cmn_log.h"
 #include "cmn_event.h"
+#include "cmn_uring.h"
+#include "cmn_mpsc.h"
+
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 
 /*
  * glibc added EPOLLRDHUP much later than the kernel support,
@@ -10,55 +15,307 @@
 # define EPOLLRDHUP 0x2000
 #endif
 
+#ifndef EPOLLEXCLUSIVE
+# define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+#define EVENT_MIN_NFD   64      /* initial size of the fd table */
+#define EVENT_MAX_SQE   4096    /* max # sqes of the uring backend */
+#define EVENT_MAX_TASK  1024    /* max # posted tasks run per wait */
+#define EVENT_MIN_BUSY  1       /* busy poll budget floor in us */
+
+/*
+ * uring user_data, the low bits tell what completed:
+ *   poll    - fd in bits 3..34 and the registration generation above
+ *   io      - pointer to a struct event_io
+ *   ignored - completions of poll removals
+ */
+#define EVENT_UD_IGNORE 0
+#define EVENT_UD_POLL   1
+#define EVENT_UD_IO     2
+#define EVENT_UD_MASK   7
+
+#define EVENT_IO_READ    0
+#define EVENT_IO_WRITE   1
+#define EVENT_IO_ACCEPT  2
+#define EVENT_IO_TIMEOUT 3
+
+struct event_io {
+    struct event_io          *next;     /* free list link */
+    struct event_base        *evb;
+    int                      op;        /* EVENT_IO_* */
+    int                      fd;
+    void                     *buf;
+    size_t                   len;
+    event_io_fn              cb;        /* completion callback */
+    void                     *arg;      /* argument of the callback */
+    struct timer             timer;     /* epoll: timeout */
+    struct __kernel_timespec ts;        /* uring: timeout */
+};
+
+struct event_task {
+    struct mpsc_node         node;
+    event_task_fn            fn;
+    void                     *arg;
+};
+
+/* hot fields first, dispatch only touches the first cache line half */
+struct event_fd {
+    uint32_t                   events;  /* registered interest, 0 if not registered */
+    uint32_t                   gen;     /* uring: generation of the registration */
+    void                       *data;   /* data passed to the callbacks */
+    const struct event_handler *handler;/* per fd callbacks, NULL uses evb->cb */
+    struct event_io            *rio;    /* epoll: pending read or accept */
+    struct event_io            *wio;    /* epoll: pending write */
+    bool                       armed;   /* uring: a poll is in flight */
+};
+
+struct event_signal {
+    event_signal_fn cb;
+    void            *arg;
+};
+
 struct event_base {
-    int                ep;      /* epoll descriptor */
+    int                ep;      /* epoll descriptor, -1 on uring */
     struct epoll_event *event;  /* event[] - events that were triggered */
     int                nevent;  /* # events */
     event_cb_fn         cb;      /* event callback */
+    struct event_fd    *fds;    /* fds[] - interest indexed by fd */
+    int                nfd;     /* # fds */
+    struct timer_wheel *tw;     /* timers fired by event_wait */
+    struct uring       *ur;     /* io_uring, NULL on epoll */
+    struct event_io    *free_io;/* free list of io requests */
+    uint32_t           nio;     /* # io requests in flight */
+    int                post_fd; /* eventfd waking the loop for posted tasks */
+    int                sleeping;/* loop is (about to be) blocked in a wait */
+    int                wakeup;  /* post_fd has been signaled */
+    struct mpsc_queue  tasks;   /* tasks posted by other threads */
+    struct event_metrics *metrics; /* NULL if not instrumented */
+    int64_t            t_wait;  /* us when the last wait started */
+    int64_t            t_wake;  /* us when the last wait returned */
+    int64_t            t_done;  /* us when the last event_wait returned */
+    int                busy_max;/* busy poll budget cap in us, 0 if off */
+    int                busy_us; /* current busy poll budget in us */
+    bool               spinning;/* in a busy poll */
+    int                sig_fd;  /* signalfd, -1 until a signal is added */
+    sigset_t           sig_mask;/* signals read from sig_fd */
+    struct event_signal *sigs;  /* sigs[] - callbacks indexed by signo */
 };
 
+static void _event_post_wakeup(void *arg, uint32_t events);
+
+static const struct event_handler event_post_handler = {
+    .read  = _event_post_wakeup,
+    .write = NULL,
+    .error = NULL,
+};
+
+static void _event_signal_read(void *arg, uint32_t events);
+
+static const struct event_handler event_signal_handler = {
+    .read  = _event_signal_read,
+    .write = NULL,
+    .error = NULL,
+};
+
+static struct uring *
+_event_uring_create(int nevent)
+{
+    struct uring *ur;
+    unsigned entries;
+
+    ur = (struct uring *)cmn_alloc(sizeof(*ur));
+    if (ur == NULL) {
+        return NULL;
+    }
+
+    entries = (unsigned)MIN(MAX(nevent, 64), EVENT_MAX_SQE);
+    if (uring_init(ur, entries) != CMN_OK) {
+        cmn_free(ur);
+        return NULL;
+    }
+
+    return ur;
+}
+
 struct event_base *
 event_base_create(int nevent, event_cb_fn cb)
+{
+    return event_base_create_backend(nevent, cb, EVENT_BACKEND_EPOLL);
+}
+
+struct event_base *
+event_base_create_backend(int nevent, event_cb_fn cb, int backend)
 {
     struct event_base *evb;
     int status, ep;
     struct epoll_event *event;
+    struct uring *ur = NULL;
 
     ASSERT(nevent > 0);
 
-    ep = epoll_create1(0);
-    if (ep < 0) {
-        log_error("epoll create1 failed: %s", strerror(errno));
-        return NULL;
+    if (backend == EVENT_BACKEND_URING) {
+        ur = _event_uring_create(nevent);
+        if (ur == NULL) {
+            log_warn("io_uring unavailable, fall back to epoll");
+        }
+    }
+
+    if (ur != NULL) {
+        ep = -1;
+    } else {
+        ep = epoll_create1(0);
+        if (ep < 0) {
+            log_error("epoll create1 failed: %s", strerror(errno));
+            return NULL;
+        }
     }
 
     event = (struct epoll_event *)cmn_calloc(nevent, sizeof(*event));
     if (event == NULL) {
-        status = close(ep);
-        if (status < 0) {
-            log_warn("close e %d failed, ignored: %s", ep, strerror(errno));
-        }
-        return NULL;
+        goto error;
     }
 
     evb = (struct event_base *)cmn_alloc(sizeof(*evb));
     if (evb == NULL) {
         cmn_free(event);
-        status = close(ep);
-        if (status < 0) {
-            log_warn("close e %d failed, ignored: %s", ep, strerror(errno));
-        }
-        return NULL;
+        goto error;
+    }
+
+    evb->tw = timer_wheel_create();
+    if (evb->tw == NULL) {
+        cmn_free(evb);
+        cmn_free(event);
+        goto error;
     }
 
     evb->ep = ep;
     evb->event = event;
     evb->nevent = nevent;
     evb->cb = cb;
+    evb->fds = NULL;
+    evb->nfd = 0;
+    evb->ur = ur;
+    evb->free_io = NULL;
+    evb->nio = 0;
+    evb->sleeping = 0;
+    evb->wakeup = 0;
+    mpsc_init(&evb->tasks);
+    evb->metrics = NULL;
+    evb->t_wait = evb->t_wake = evb->t_done = 0;
+    evb->busy_max = evb->busy_us = 0;
+    evb->spinning = false;
+    evb->sig_fd = -1;
+    sigemptyset(&evb->sig_mask);
+    evb->sigs = NULL;
+
+    evb->post_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (evb->post_fd < 0) {
+        log_error("eventfd creation failed: %s", strerror(errno));
+        goto error_evb;
+    }
 
-    log_info("epoll fd %d with nevent %d", evb->ep, evb->nevent);
+    if (event_register(evb, evb->post_fd, EVENT_READ, &event_post_handler, evb) < 0) {
+        close(evb->post_fd);
+        goto error_evb;
+    }
+
+    if (ur != NULL) {
+        log_info("io_uring fd %d with nevent %d", ur->fd, evb->nevent);
+    } else {
+        log_info("epoll fd %d with nevent %d", evb->ep, evb->nevent);
+    }
 
     return evb;
+
+error_evb:
+    if (evb->fds != NULL) {
+        cmn_free(evb->fds);
+    }
+    timer_wheel_destroy(&evb->tw);
+    cmn_free(evb);
+    cmn_free(event);
+
+error:
+    if (ur != NULL) {
+        uring_exit(ur);
+        cmn_free(ur);
+    } else {
+        status = close(ep);
+        if (status < 0) {
+            log_warn("close e %d failed, ignored: %s", ep, strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+void
+event_base_metrics(struct event_base *evb, struct event_metrics *m)
+{
+    ASSERT(evb != NULL);
+
+    evb->metrics = m;
+    evb->t_done = 0;
+}
+
+void
+event_metrics_snapshot(struct event_metrics *dst, struct event_metrics *m)
+{
+    ASSERT(dst != NULL && m != NULL);
+
+    *dst = *m;
+    dst->event_loop_lag_max.gauge =
+        __atomic_exchange_n(&m->event_loop_lag_max.gauge, 0, __ATOMIC_RELAXED);
+    dst->event_cb_max_us.gauge =
+        __atomic_exchange_n(&m->event_cb_max_us.gauge, 0, __ATOMIC_RELAXED);
+    /* best effort, a peak raised in between may pair with newer data */
+    dst->cb_max_data = __atomic_exchange_n(&m->cb_max_data, NULL, __ATOMIC_RELAXED);
+}
+
+void
+event_base_busy_poll(struct event_base *evb, int max_us)
+{
+    ASSERT(evb != NULL);
+
+    evb->busy_max = MAX(max_us, 0);
+    evb->busy_us = evb->busy_max;
+}
+
+int
+event_base_backend(struct event_base *evb)
+{
+    ASSERT(evb != NULL);
+
+    return evb->ur != NULL ? EVENT_BACKEND_URING : EVENT_BACKEND_EPOLL;
+}
+
+/*
+ * run up to EVENT_MAX_TASK posted tasks, so busy posters can not starve the
+ * I/O; on destroy drop all of them. returns # tasks
+ */
+static int
+_event_run_tasks(struct event_base *evb, bool is_run)
+{
+    struct mpsc_node *n;
+    struct event_task *task;
+    int ntask = 0;
+
+    while ((!is_run || ntask < EVENT_MAX_TASK) && (n = mpsc_pop(&evb->tasks)) != NULL) {
+        task = (struct event_task *)n;
+
+        if (is_run) {
+            task->fn(task->arg);
+        }
+
+        cmn_free(task);
+        ntask++;
+    }
+
+    if (!is_run && ntask > 0) {
+        log_warn("drop %d tasks posted to event base %p", ntask, evb);
+    }
+
+    return ntask;
 }
 
 void
@@ -71,13 +328,48 @@ event_base_destroy(struct event_base **evb)
         return;
     }
 
-    ASSERT(e->ep > 0);
+    ASSERT(e->ep > 0 || e->ur != NULL);
 
-    cmn_free(e->event);
+    if (e->nio > 0) {
+        log_warn("destroy event base %p with %u io requests in flight", e, e->nio);
+    }
+
+    _event_run_tasks(e, false);
+
+    if (e->sig_fd >= 0) {
+        pthread_sigmask(SIG_UNBLOCK, &e->sig_mask, NULL);
+        close(e->sig_fd);
+    }
+    if (e->sigs != NULL) {
+        cmn_free(e->sigs);
+    }
 
-    status = close(e->ep);
+    status = close(e->post_fd);
     if (status < 0) {
-        log_warn("close e %d failed, ignored: %s", e->ep, strerror(errno));
+        log_warn("close eventfd %d failed, ignored: %s", e->post_fd, strerror(errno));
+    }
+
+    while (e->free_io != NULL) {
+        struct event_io *io = e->free_io;
+
+        e->free_io = io->next;
+        cmn_free(io);
+    }
+
+    cmn_free(e->event);
+    if (e->fds != NULL) {
+        cmn_free(e->fds);
+    }
+    timer_wheel_destroy(&e->tw);
+
+    if (e->ur != NULL) {
+        uring_exit(e->ur);
+        cmn_free(e->ur);
+    } else {
+        status = close(e->ep);
+        if (status < 0) {
+            log_warn("close e %d failed, ignored: %s", e->ep, strerror(errno));
+        }
     }
     e->ep = -1;
 
@@ -86,145 +378,1289 @@ event_base_destroy(struct event_base **evb)
     *evb = NULL;
 }
 
+static inline uint32_t
+_event_epoll_events(uint32_t events)
+{
+    uint32_t ev = 0;
+
+    if (events & EVENT_READ) {
+        ev |= EPOLLIN;
+    }
+
+    if (events & EVENT_WRITE) {
+        ev |= EPOLLOUT;
+    }
+
+    if (events & EVENT_ET) {
+        ev |= EPOLLET;
+    }
+
+    if (events & EVENT_ONESHOT) {
+        ev |= EPOLLONESHOT;
+    }
+
+    if (events & EVENT_EXCLUSIVE) {
+        ev |= EPOLLEXCLUSIVE;
+    }
+
+    return ev;
+}
+
+/*
+ * get the table entry of fd, growing the table if needed
+ */
+static struct event_fd *
+_event_fd_get(struct event_base *evb, int fd)
+{
+    struct event_fd *fds;
+    int nfd;
+
+    if (fd < evb->nfd) {
+        return &evb->fds[fd];
+    }
+
+    nfd = MAX(evb->nfd, EVENT_MIN_NFD);
+    while (nfd <= fd) {
+        nfd *= 2;
+    }
+
+    fds = (struct event_fd *)cmn_realloc(evb->fds, nfd * sizeof(*fds));
+    if (fds == NULL) {
+        log_error("grow fd table of epoll fd %d to %d failed", evb->ep, nfd);
+        return NULL;
+    }
+    memset(fds + evb->nfd, 0, (nfd - evb->nfd) * sizeof(*fds));
+
+    evb->fds = fds;
+    evb->nfd = nfd;
+
+    return &evb->fds[fd];
+}
+
 static int
-_event_update(struct event_base *evb, int fd, int op, uint32_t events, void *ptr)
+_event_update(struct event_base *evb, int fd, int op, uint32_t events)
 {
     struct epoll_event event;
 
-    event.events = events;
-    event.data.ptr = ptr;
+    event.events = _event_epoll_events(events);
+    event.data.u64 = 0;
+    event.data.fd = fd;
 
     return epoll_ctl(evb->ep, op, fd, &event);
 }
 
-int event_add_read(struct event_base *evb, int fd, void *data)
+static inline uint64_t
+_event_ud_poll(int fd, uint32_t gen)
 {
-    int status;
+    return ((uint64_t)gen << 35) | ((uint64_t)(uint32_t)fd << 3) | EVENT_UD_POLL;
+}
 
-    ASSERT(evb != NULL && evb->ep > 0);
-    ASSERT(fd >= 0);
+/*
+ * arm a oneshot poll for the interest of fd, the completion re-arms it
+ * unless the registration is EVENT_ONESHOT
+ */
+static int
+_event_uring_arm(struct event_base *evb, int fd, struct event_fd *efd)
+{
+    struct io_uring_sqe *sqe;
 
-    status = _event_update(evb, fd, EPOLL_CTL_ADD, EPOLLIN, data);
-    if (status < 0 && errno != EEXIST) {
-        log_error("ctl (add read) w/ epoll fd %d on fd %d failed: %s", evb->ep,
-                fd, strerror(errno));
+    sqe = uring_get_sqe(evb->ur);
+    if (sqe == NULL) {
+        return CMN_ERROR;
     }
 
-    log_debug("add read event to epoll fd %d on fd %d", evb->ep, fd);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = _event_epoll_events(efd->events & (EVENT_READ | EVENT_WRITE));
+    sqe->user_data = _event_ud_poll(fd, efd->gen);
+    efd->armed = true;
 
-    return status;
+    return CMN_OK;
 }
 
-int
-event_add_write(struct event_base *evb, int fd, void *data)
+static int
+_event_uring_update(struct event_base *evb, int fd, struct event_fd *efd, uint32_t events)
 {
-    int status;
+    struct io_uring_sqe *sqe;
 
-    ASSERT(evb != NULL && evb->ep > 0);
-    ASSERT(fd >= 0);
+    if (efd->armed) {
+        sqe = uring_get_sqe(evb->ur);
+        if (sqe == NULL) {
+            return CMN_ERROR;
+        }
 
-    status = _event_update(evb, fd, EPOLL_CTL_ADD, EPOLLOUT, data);
-    if (status < 0 && errno != EEXIST) {
-        log_error("ctl (add write) w/ epoll fd %d on fd %d failed: %s", evb->ep,
-                 fd, strerror(errno));
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = _event_ud_poll(fd, efd->gen);
+        sqe->user_data = EVENT_UD_IGNORE;
+        efd->armed = false;
     }
-    log_debug("add write event to epoll fd %d on fd %d", evb->ep, fd);
 
-    return status;
+    /* completions of the old registration are ignored from now on */
+    efd->gen++;
+    efd->events = events;
+
+    if (events == 0) {
+        return CMN_OK;
+    }
+
+    return _event_uring_arm(evb, fd, efd);
 }
 
-int
-event_del(struct event_base *evb, int fd)
+/*
+ * set the interest of fd to events, only touching epoll when the
+ * registered interest actually changes
+ */
+static int
+_event_set(struct event_base *evb, int fd, uint32_t events, void *data)
 {
-    int status;
+    struct event_fd *efd;
+    int status, op;
 
-    ASSERT(evb != NULL && evb->ep > 0);
-    ASSERT(fd >= 0);
+    /* EPOLLEXCLUSIVE can not be combined with EPOLLONESHOT */
+    ASSERT(!((events & EVENT_EXCLUSIVE) && (events & EVENT_ONESHOT)));
+
+    efd = _event_fd_get(evb, fd);
+    if (efd == NULL) {
+        return CMN_ERROR;
+    }
+
+    if ((events & (EVENT_READ | EVENT_WRITE)) == 0) {
+        events = 0;
+    }
+
+    /* a oneshot fd may have been disabled by the kernel, always rearm it */
+    if (efd->events == events && efd->data == data && !(events & EVENT_ONESHOT)) {
+        return CMN_OK;
+    }
+
+    if (evb->ur != NULL) {
+        status = _event_uring_update(evb, fd, efd, events);
+        if (status < 0) {
+            efd->events = 0;
+            efd->data = NULL;
+            efd->handler = NULL;
+            return status;
+        }
+        efd->data = events != 0 ? data : NULL;
+        if (events == 0) {
+            efd->handler = NULL;
+        }
+        return CMN_OK;
+    }
+
+    if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    } else if (efd->events == 0) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    /* an exclusive registration can not be modified, only deleted and added */
+    if (op == EPOLL_CTL_MOD && ((efd->events | events) & EVENT_EXCLUSIVE)) {
+        status = _event_update(evb, fd, EPOLL_CTL_DEL, 0);
+        if (status < 0 && errno != ENOENT) {
+            log_error("ctl (del) w/ epoll fd %d on fd %d failed: %s", evb->ep,
+                    fd, strerror(errno));
+            return status;
+        }
+        op = EPOLL_CTL_ADD;
+    }
+
+    status = _event_update(evb, fd, op, events);
+    if (status < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+        /* fd was closed and reused without event_del */
+        op = EPOLL_CTL_ADD;
+        status = _event_update(evb, fd, op, events);
+    } else if (status < 0 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+        op = EPOLL_CTL_MOD;
+        status = _event_update(evb, fd, op, events);
+    }
 
-    /* event can be NULL in kernel >=2.6.9, here we keep it for compatibility */
-    status = _event_update(evb, fd, EPOLL_CTL_DEL, 0, NULL);
     if (status < 0) {
-        log_error("ctl (del) w/ epoll fd %d on fd %d failed: %s", evb->ep, fd,
-                strerror(errno));
+        log_error("ctl (op %d events %04x) w/ epoll fd %d on fd %d failed: %s",
+                op, events, evb->ep, fd, strerror(errno));
+        return status;
     }
 
-    log_debug("del fd %d from epoll fd %d", fd, evb->ep);
+    efd->events = events;
+    efd->data = events != 0 ? data : NULL;
+    if (events == 0) {
+        efd->handler = NULL;
+    }
+
+    log_debug("ctl (op %d events %04x) w/ epoll fd %d on fd %d", op, events,
+            evb->ep, fd);
 
     return status;
 }
 
-
-/*
- * create a timed event with event base function and timeout (in millisecond)
- */
 int
-event_wait(struct event_base *evb, int timeout)
+event_add(struct event_base *evb, int fd, uint32_t events, void *data)
 {
-    struct epoll_event *ev_arr;
-    int nevent;
-    int ep;
-    int i, nreturned;
+    uint32_t old;
 
     ASSERT(evb != NULL);
+    ASSERT(fd >= 0);
+    ASSERT((events & ~(EVENT_READ | EVENT_WRITE | EVENT_MODE)) == 0);
 
-    ep = evb->ep;
-    ev_arr = evb->event;
-    nevent = evb->nevent;
+    old = fd < evb->nfd ? evb->fds[fd].events : 0;
 
-    ASSERT(ep > 0);
-    ASSERT(ev_arr != NULL);
-    ASSERT(nevent > 0);
+    return _event_set(evb, fd, old | events, data);
+}
 
-    for (;;) {
+int
+event_mod(struct event_base *evb, int fd, uint32_t events, void *data)
+{
+    ASSERT(evb != NULL);
+    ASSERT(fd >= 0);
+    ASSERT((events & ~(EVENT_READ | EVENT_WRITE | EVENT_MODE)) == 0);
 
-        nreturned = epoll_wait(ep, ev_arr, nevent, timeout);
-        if (nreturned > 0) {
-            for (i = 0; i < nreturned; i++) {
-                struct epoll_event *ev = ev_arr + i;
-                uint32_t events = 0;
+    return _event_set(evb, fd, events, data);
+}
 
-                log_debug("epoll %04"PRIX32" against data %p", ev->events, ev->data.ptr);
+int
+event_register(struct event_base *evb, int fd, uint32_t events,
+               const struct event_handler *h, void *data)
+{
+    int status;
 
-                if (ev->events & (EPOLLERR | EPOLLHUP)) {
-                    events |= EVENT_ERR;
-                }
+    ASSERT(evb != NULL);
+    ASSERT(fd >= 0);
+    ASSERT(h != NULL);
+    ASSERT((events & ~(EVENT_READ | EVENT_WRITE | EVENT_MODE)) == 0);
 
-                if (ev->events & (EPOLLIN | EPOLLRDHUP)) {
-                    events |= EVENT_READ;
-                }
+    status = _event_set(evb, fd, events, data);
+    if (status < 0) {
+        return status;
+    }
 
-                if (ev->events & EPOLLOUT) {
-                    events |= EVENT_WRITE;
-                }
+    if (events & (EVENT_READ | EVENT_WRITE)) {
+        evb->fds[fd].handler = h;
+    }
 
-                if (evb->cb != NULL) {
-                    evb->cb(ev->data.ptr, events);
-                }
-            }
+    return status;
+}
 
-            log_debug("returned %d events from epoll fd %d", nreturned, ep);
+int
+event_rearm(struct event_base *evb, int fd)
+{
+    struct event_fd *efd;
+    int status;
 
-            return nreturned;
-        }
+    ASSERT(evb != NULL);
+    ASSERT(fd >= 0);
 
-        if (nreturned == 0) {
-            if (timeout == -1) {
-               log_error("indefinite wait on epoll fd %d with %d events returned no events", ep, nevent);
-                return CMN_EEVENT;
-            }
+    if (fd >= evb->nfd || evb->fds[fd].events == 0) {
+        log_error("rearm w/ epoll fd %d on unregistered fd %d", evb->ep, fd);
+        return CMN_ERROR;
+    }
 
-            log_debug("wait on epoll fd %d with nevent %d timeout %d returned no events", ep, nevent, timeout);
-            return CMN_OK;
-        }
+    efd = &evb->fds[fd];
+    ASSERT(efd->events & EVENT_ONESHOT);
 
-        if (errno == EINTR) {
-            continue;
-        }
+    if (evb->ur != NULL) {
+        return efd->armed ? CMN_OK : _event_uring_arm(evb, fd, efd);
+    }
+
+    status = _event_update(evb, fd, EPOLL_CTL_MOD, efd->events);
+    if (status < 0) {
+        log_error("ctl (rearm) w/ epoll fd %d on fd %d failed: %s", evb->ep,
+                fd, strerror(errno));
+    }
+
+    return status;
+}
+
+int
+event_add_read(struct event_base *evb, int fd, void *data)
+{
+    return event_add(evb, fd, EVENT_READ, data);
+}
+
+int
+event_add_write(struct event_base *evb, int fd, void *data)
+{
+    return event_add(evb, fd, EVENT_WRITE, data);
+}
+
+int
+event_del_read(struct event_base *evb, int fd)
+{
+    ASSERT(evb != NULL);
+    ASSERT(fd >= 0);
+
+    if (fd >= evb->nfd) {
+        return CMN_OK;
+    }
+
+    return _event_set(evb, fd, evb->fds[fd].events & ~EVENT_READ, evb->fds[fd].data);
+}
+
+int
+event_del_write(struct event_base *evb, int fd)
+{
+    ASSERT(evb != NULL);
+    ASSERT(fd >= 0);
+
+    if (fd >= evb->nfd) {
+        return CMN_OK;
+    }
+
+    return _event_set(evb, fd, evb->fds[fd].events & ~EVENT_WRITE, evb->fds[fd].data);
+}
+
+int
+event_del(struct event_base *evb, int fd)
+{
+    int status;
+
+    ASSERT(evb != NULL);
+    ASSERT(fd >= 0);
+
+    if (fd < evb->nfd && evb->fds[fd].events != 0) {
+        return _event_set(evb, fd, 0, NULL);
+    }
+
+    if (evb->ur != NULL) {
+        return CMN_OK;
+    }
+
+    /* not tracked, let epoll tell whether it is registered */
+    status = _event_update(evb, fd, EPOLL_CTL_DEL, 0);
+    if (status < 0) {
+        log_error("ctl (del) w/ epoll fd %d on fd %d failed: %s", evb->ep, fd,
+                strerror(errno));
+    }
+
+    log_debug("del fd %d from epoll fd %d", fd, evb->ep);
+
+    return status;
+}
+
+uint32_t
+event_interest(struct event_base *evb, int fd)
+{
+    ASSERT(evb != NULL);
+
+    if (fd < 0 || fd >= evb->nfd) {
+        return 0;
+    }
+
+    return evb->fds[fd].events;
+}
+
+void
+event_timer_add(struct event_base *evb, struct timer *t, int64_t timeout)
+{
+    ASSERT(evb != NULL);
+
+    timer_wheel_add(evb->tw, t, timeout);
+}
+
+void
+event_timer_del(struct event_base *evb, struct timer *t)
+{
+    ASSERT(evb != NULL);
+
+    timer_wheel_del(evb->tw, t);
+}
+
+static inline uint32_t
+_event_from_epoll(uint32_t ev)
+{
+    uint32_t events = 0;
+
+    if (ev & (EPOLLERR | EPOLLHUP)) {
+        events |= EVENT_ERR;
+    }
+
+    if (ev & (EPOLLIN | EPOLLRDHUP)) {
+        events |= EVENT_READ;
+    }
+
+    if (ev & EPOLLOUT) {
+        events |= EVENT_WRITE;
+    }
+
+    return events;
+}
+
+static struct event_io *
+_event_io_get(struct event_base *evb)
+{
+    struct event_io *io;
+
+    io = evb->free_io;
+    if (io != NULL) {
+        evb->free_io = io->next;
+    } else {
+        io = (struct event_io *)cmn_alloc(sizeof(*io));
+        if (io == NULL) {
+            log_error("io request creation failed, %s", strerror(errno));
+            return NULL;
+        }
+    }
 
-        log_error("wait on epoll fd %d with nevent %d and timeout %d failed: %s", ep, nevent, strerror(errno));
+    io->next = NULL;
+    io->evb = evb;
+    evb->nio++;
+
+    return io;
+}
+
+static void
+_event_io_put(struct event_base *evb, struct event_io *io)
+{
+    io->next = evb->free_io;
+    evb->free_io = io;
+    evb->nio--;
+}
+
+/* recycle io before the callback, so the callback can submit again */
+static void
+_event_io_done(struct event_io *io, int res)
+{
+    event_io_fn cb = io->cb;
+    void *arg = io->arg;
+
+    _event_io_put(io->evb, io);
+
+    cb(arg, res);
+}
+
+static void
+_event_io_timeout(void *arg)
+{
+    _event_io_done((struct event_io *)arg, -ETIME);
+}
+
+/* epoll: run the syscall of io on a ready fd, returns its result or -errno */
+static int
+_event_io_perform(struct event_io *io)
+{
+    ssize_t n;
+
+    for (;;) {
+        switch (io->op) {
+        case EVENT_IO_READ:
+            n = read(io->fd, io->buf, io->len);
+            break;
+
+        case EVENT_IO_WRITE:
+            n = write(io->fd, io->buf, io->len);
+            break;
+
+        case EVENT_IO_ACCEPT:
+            n = accept4(io->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            break;
+
+        default:
+            NOT_REACHED();
+            return -EINVAL;
+        }
+
+        if (n >= 0) {
+            return (int)n;
+        }
+
+        if (errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+
+/* epoll: complete the pending io of a ready fd */
+static void
+_event_io_ready(struct event_base *evb, int fd, uint32_t events)
+{
+    struct event_fd *efd = &evb->fds[fd];
+    struct event_io *io;
+    uint32_t interest;
+    int res;
+
+    io = efd->rio;
+    if (io != NULL && (events & (EVENT_READ | EVENT_ERR))) {
+        res = _event_io_perform(io);
+        if (res != -EAGAIN && res != -EWOULDBLOCK) {
+            efd->rio = NULL;
+            _event_io_done(io, res);
+        }
+    }
+
+    /* the callback may have grown the fd table */
+    efd = &evb->fds[fd];
+
+    io = efd->wio;
+    if (io != NULL && (events & (EVENT_WRITE | EVENT_ERR))) {
+        res = _event_io_perform(io);
+        if (res != -EAGAIN && res != -EWOULDBLOCK) {
+            efd->wio = NULL;
+            _event_io_done(io, res);
+        }
+    }
+
+    efd = &evb->fds[fd];
+
+    interest = efd->events;
+    if (efd->rio == NULL) {
+        interest &= ~EVENT_READ;
+    }
+    if (efd->wio == NULL) {
+        interest &= ~EVENT_WRITE;
+    }
+
+    if (interest != efd->events) {
+        _event_set(evb, fd, interest, efd->data);
+    }
+}
+
+static void
+_event_post_wakeup(void *arg, uint32_t events)
+{
+    struct event_base *evb = arg;
+    uint64_t count;
+
+    /* clear first, a post racing with the read signals again */
+    __atomic_store_n(&evb->wakeup, 0, __ATOMIC_SEQ_CST);
+
+    if (read(evb->post_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_warn("read eventfd %d failed, ignored: %s", evb->post_fd, strerror(errno));
+    }
+}
+
+static void
+_event_signal_read(void *arg, uint32_t events)
+{
+    struct event_base *evb = arg;
+    struct signalfd_siginfo si[8];
+    struct event_signal *sig;
+    ssize_t n;
+    int i, signo;
+
+    for (;;) {
+        n = read(evb->sig_fd, si, sizeof(si));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                log_warn("read signalfd %d failed, ignored: %s", evb->sig_fd,
+                         strerror(errno));
+            }
+            return;
+        }
+
+        for (i = 0; i < n / (ssize_t)sizeof(si[0]); i++) {
+            signo = (int)si[i].ssi_signo;
+            if (signo <= 0 || signo >= NSIG) {
+                continue;
+            }
+
+            /* an earlier callback may have deleted the signal */
+            sig = &evb->sigs[signo];
+            if (sig->cb != NULL) {
+                sig->cb(sig->arg, signo);
+            }
+        }
+
+        if (n < (ssize_t)sizeof(si)) {
+            return;
+        }
+    }
+}
+
+/*
+ * call the handler of fd: error goes to h->error if set, otherwise to the
+ * read and write callbacks so they see the failure on their next syscall
+ */
+static void
+_event_handle(struct event_base *evb, int fd, const struct event_handler *h,
+              void *data, uint32_t events)
+{
+    struct event_fd *efd;
+
+    if ((events & EVENT_ERR) && h->error != NULL) {
+        h->error(data, events);
+        return;
+    }
+
+    if ((events & (EVENT_READ | EVENT_ERR)) && h->read != NULL) {
+        h->read(data, events);
+
+        /* the read callback may have deleted or replaced fd */
+        efd = &evb->fds[fd];
+        if (efd->handler != h || efd->data != data) {
+            return;
+        }
+    }
+
+    if ((events & (EVENT_WRITE | EVENT_ERR)) && h->write != NULL) {
+        h->write(data, events);
+    }
+}
+
+static void
+_event_dispatch(struct event_base *evb, int fd, uint32_t events)
+{
+    struct event_fd *efd = &evb->fds[fd];
+
+    if (efd->handler != NULL) {
+        _event_handle(evb, fd, efd->handler, efd->data, events);
+        return;
+    }
+
+    if (efd->rio != NULL || efd->wio != NULL) {
+        _event_io_ready(evb, fd, events);
+        return;
+    }
+
+    if (evb->cb != NULL) {
+        evb->cb(efd->data, events);
+    }
+}
+
+/*
+ * raise a peak gauge, returns true if val is the new peak. cas so that a
+ * concurrent reset by event_metrics_snapshot is never overwritten by a peak
+ * of the previous window
+ */
+static inline bool
+_event_metric_peak(struct metric *peak, int64_t val)
+{
+    int64_t cur = __atomic_load_n(&peak->gauge, __ATOMIC_RELAXED);
+
+    while (val > cur) {
+        if (__atomic_compare_exchange_n(&peak->gauge, &cur, val, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+_event_dispatch_timed(struct event_base *evb, int fd, uint32_t events)
+{
+    struct event_metrics *m = evb->metrics;
+    void *data = evb->fds[fd].data;     /* the callback may unregister fd */
+    int64_t start, us;
+
+    start = cmn_usec_mono();
+    _event_dispatch(evb, fd, events);
+    us = cmn_usec_mono() - start;
+
+    if (us < 10) {
+        INCR(m, event_cb_10us);
+    } else if (us < 100) {
+        INCR(m, event_cb_100us);
+    } else if (us < 1000) {
+        INCR(m, event_cb_1ms);
+    } else if (us < 10000) {
+        INCR(m, event_cb_10ms);
+    } else {
+        INCR(m, event_cb_inf);
+    }
+
+    if (_event_metric_peak(&m->event_cb_max_us, us)) {
+        __atomic_store_n(&m->cb_max_data, data, __ATOMIC_RELAXED);
+    }
+}
+
+/* the only cost of disabled metrics is this branch */
+static inline void
+_event_call(struct event_base *evb, int fd, uint32_t events)
+{
+    if (evb->metrics != NULL) {
+        _event_dispatch_timed(evb, fd, events);
+    } else {
+        _event_dispatch(evb, fd, events);
+    }
+}
+
+static void
+_event_metric_wake(struct event_base *evb, int nreturned)
+{
+    struct event_metrics *m = evb->metrics;
+
+    if (evb->spinning && nreturned <= 0) {
+        /* empty busy polls are accounted by _event_busy_poll */
+        return;
+    }
+
+    evb->t_wake = cmn_usec_mono();
+    INCR_N(m, event_wait_us, evb->t_wake - evb->t_wait);
+
+    if (nreturned <= 0) {
+        INCR(m, event_nevent_0);
+    } else if (nreturned == 1) {
+        INCR(m, event_nevent_1);
+    } else if (nreturned <= 4) {
+        INCR(m, event_nevent_4);
+    } else if (nreturned <= 16) {
+        INCR(m, event_nevent_16);
+    } else if (nreturned <= 64) {
+        INCR(m, event_nevent_64);
+    } else {
+        INCR(m, event_nevent_inf);
+    }
+}
+
+static int
+_event_io_submit(struct event_base *evb, int op, int fd, void *buf, size_t len,
+                 event_io_fn cb, void *arg)
+{
+    struct io_uring_sqe *sqe;
+    struct event_fd *efd;
+    struct event_io *io, **pending;
+    int status;
+
+    ASSERT(evb != NULL && cb != NULL);
+
+    io = _event_io_get(evb);
+    if (io == NULL) {
+        return CMN_ERROR;
+    }
+
+    io->op = op;
+    io->fd = fd;
+    io->buf = buf;
+    io->len = len;
+    io->cb = cb;
+    io->arg = arg;
+
+    if (evb->ur != NULL) {
+        sqe = uring_get_sqe(evb->ur);
+        if (sqe == NULL) {
+            _event_io_put(evb, io);
+            return CMN_ERROR;
+        }
+
+        switch (op) {
+        case EVENT_IO_READ:
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)(uintptr_t)buf;
+            sqe->len = (uint32_t)MIN(len, UINT32_MAX);
+            sqe->off = (uint64_t)-1;
+            break;
+
+        case EVENT_IO_WRITE:
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)(uintptr_t)buf;
+            sqe->len = (uint32_t)MIN(len, UINT32_MAX);
+            sqe->off = (uint64_t)-1;
+            break;
+
+        case EVENT_IO_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = fd;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            break;
+
+        case EVENT_IO_TIMEOUT:
+            io->ts.tv_sec = (int64_t)len / 1000;
+            io->ts.tv_nsec = ((int64_t)len % 1000) * 1000000LL;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)&io->ts;
+            sqe->len = 1;
+            break;
+
+        default:
+            NOT_REACHED();
+        }
+
+        sqe->user_data = (uint64_t)(uintptr_t)io | EVENT_UD_IO;
+
+        return CMN_OK;
+    }
+
+    if (op == EVENT_IO_TIMEOUT) {
+        timer_init(&io->timer, _event_io_timeout, io);
+        timer_wheel_add(evb->tw, &io->timer, (int64_t)len);
+        return CMN_OK;
+    }
+
+    /* epoll: wait for readiness, then run the syscall in event_wait */
+    efd = _event_fd_get(evb, fd);
+    if (efd == NULL) {
+        _event_io_put(evb, io);
+        return CMN_ERROR;
+    }
+
+    pending = op == EVENT_IO_WRITE ? &efd->wio : &efd->rio;
+    if (*pending != NULL) {
+        log_error("fd %d has a %s request in flight", fd,
+                  op == EVENT_IO_WRITE ? "write" : "read");
+        _event_io_put(evb, io);
+        errno = EBUSY;
+        return CMN_ERROR;
+    }
+
+    *pending = io;
+
+    status = _event_set(evb, fd, efd->events | (op == EVENT_IO_WRITE ? EVENT_WRITE : EVENT_READ),
+                        efd->data);
+    if (status < 0) {
+        efd = &evb->fds[fd];
+        if (op == EVENT_IO_WRITE) {
+            efd->wio = NULL;
+        } else {
+            efd->rio = NULL;
+        }
+        _event_io_put(evb, io);
+        return CMN_ERROR;
+    }
+
+    return CMN_OK;
+}
+
+int
+event_submit_read(struct event_base *evb, int fd, void *buf, size_t len,
+                  event_io_fn cb, void *arg)
+{
+    ASSERT(fd >= 0 && buf != NULL && len > 0);
+
+    return _event_io_submit(evb, EVENT_IO_READ, fd, buf, len, cb, arg);
+}
+
+int
+event_submit_write(struct event_base *evb, int fd, void *buf, size_t len,
+                   event_io_fn cb, void *arg)
+{
+    ASSERT(fd >= 0 && buf != NULL && len > 0);
+
+    return _event_io_submit(evb, EVENT_IO_WRITE, fd, buf, len, cb, arg);
+}
+
+int
+event_submit_accept(struct event_base *evb, int fd, event_io_fn cb, void *arg)
+{
+    ASSERT(fd >= 0);
+
+    return _event_io_submit(evb, EVENT_IO_ACCEPT, fd, NULL, 0, cb, arg);
+}
+
+int
+event_submit_timeout(struct event_base *evb, int64_t timeout, event_io_fn cb, void *arg)
+{
+    ASSERT(timeout >= 0);
+
+    return _event_io_submit(evb, EVENT_IO_TIMEOUT, -1, NULL, (size_t)timeout, cb, arg);
+}
+
+/* returns true when a callback was dispatched */
+static bool
+_event_uring_complete(struct event_base *evb, uint64_t ud, int res)
+{
+    struct event_fd *efd;
+    uint32_t gen;
+    int fd;
+
+    switch (ud & EVENT_UD_MASK) {
+    case EVENT_UD_IO:
+        _event_io_done((struct event_io *)(uintptr_t)(ud & ~(uint64_t)EVENT_UD_MASK), res);
+        return true;
+
+    case EVENT_UD_POLL:
+        fd = (int)(uint32_t)(ud >> 3);
+        gen = (uint32_t)(ud >> 35);
+
+        if (fd >= evb->nfd) {
+            return false;
+        }
+
+        efd = &evb->fds[fd];
+        if ((uint32_t)(efd->gen & (UINT32_MAX >> 3)) != gen || efd->events == 0) {
+            /* completion of a removed or replaced registration */
+            return false;
+        }
+        efd->armed = false;
+
+        _event_call(evb, fd, res < 0 ? EVENT_ERR : _event_from_epoll((uint32_t)res));
+
+        efd = &evb->fds[fd];
+        if ((uint32_t)(efd->gen & (UINT32_MAX >> 3)) == gen && efd->events != 0 &&
+            !efd->armed && !(efd->events & EVENT_ONESHOT)) {
+            _event_uring_arm(evb, fd, efd);
+        }
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static int
+_event_wait_uring(struct event_base *evb, int timeout)
+{
+    struct uring *ur = evb->ur;
+    struct io_uring_cqe *cqe;
+    uint64_t ud;
+    int i, n, res;
+
+    for (;;) {
+        if (uring_enter(ur, 1, timeout) >= 0) {
+            break;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno == ETIME || errno == EBUSY || errno == EAGAIN) {
+            /* timed out or completions have to be reaped first */
+            break;
+        }
+
+        log_error("wait on io_uring fd %d with timeout %d failed: %s", ur->fd,
+                  timeout, strerror(errno));
+        return CMN_ERROR;
+    }
+
+    if (evb->metrics != NULL) {
+        _event_metric_wake(evb, (int)MIN(uring_cq_ready(ur), (unsigned)evb->nevent));
+    }
+
+    /* like epoll, count only the completions that reached a callback */
+    for (i = 0, n = 0; i < evb->nevent; i++) {
+        cqe = uring_peek_cqe(ur);
+        if (cqe == NULL) {
+            break;
+        }
+
+        ud = cqe->user_data;
+        res = cqe->res;
+        uring_cqe_seen(ur);
+
+        if (_event_uring_complete(evb, ud, res)) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+static int
+_event_wait_epoll(struct event_base *evb, int timeout)
+{
+    struct epoll_event *ev_arr;
+    int nevent;
+    int ep;
+    int i, nreturned;
+
+    ep = evb->ep;
+    ev_arr = evb->event;
+    nevent = evb->nevent;
+
+    ASSERT(ep > 0);
+    ASSERT(ev_arr != NULL);
+    ASSERT(nevent > 0);
+
+    for (;;) {
+
+        nreturned = epoll_wait(ep, ev_arr, nevent, timeout);
+        if (evb->metrics != NULL && nreturned >= 0) {
+            _event_metric_wake(evb, nreturned);
+        }
+
+        if (nreturned > 0) {
+            for (i = 0; i < nreturned; i++) {
+                struct epoll_event *ev = ev_arr + i;
+
+                ASSERT(ev->data.fd >= 0 && ev->data.fd < evb->nfd);
+
+                log_debug("epoll %04"PRIX32" against fd %d", ev->events, ev->data.fd);
+
+                if (evb->fds[ev->data.fd].events == 0) {
+                    /* deleted by an earlier callback of this round */
+                    continue;
+                }
+
+                _event_call(evb, ev->data.fd, _event_from_epoll(ev->events));
+            }
+
+            log_debug("returned %d events from epoll fd %d", nreturned, ep);
+
+            return nreturned;
+        }
+
+        if (nreturned == 0) {
+            return 0;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        log_error("wait on epoll fd %d with nevent %d and timeout %d failed: %s", ep, nevent, timeout,
+                strerror(errno));
 
         return CMN_ERROR;
     }
 
     return CMN_ERROR;
 }
+
+int
+event_signal_add(struct event_base *evb, int signo, event_signal_fn cb, void *arg)
+{
+    sigset_t mask, one;
+    int fd;
+
+    ASSERT(evb != NULL && cb != NULL);
+
+    if (signo <= 0 || signo >= NSIG || signo == SIGKILL || signo == SIGSTOP) {
+        log_error("add signal %d to event base %p failed: invalid signal", signo, evb);
+        return CMN_ERROR;
+    }
+
+    if (evb->sigs == NULL) {
+        evb->sigs = (struct event_signal *)cmn_calloc(NSIG, sizeof(*evb->sigs));
+        if (evb->sigs == NULL) {
+            log_error("signal table creation failed: %s", strerror(errno));
+            return CMN_ERROR;
+        }
+    }
+
+    mask = evb->sig_mask;
+    sigaddset(&mask, signo);
+
+    /* a blocked signal stays pending until the signalfd reads it */
+    sigemptyset(&one);
+    sigaddset(&one, signo);
+    if (pthread_sigmask(SIG_BLOCK, &one, NULL) != 0) {
+        log_error("block signal %d failed", signo);
+        return CMN_ERROR;
+    }
+
+    fd = signalfd(evb->sig_fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        log_error("signalfd for signal %d failed: %s", signo, strerror(errno));
+        if (!sigismember(&evb->sig_mask, signo)) {
+            pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+        }
+        return CMN_ERROR;
+    }
+
+    if (evb->sig_fd < 0) {
+        if (event_register(evb, fd, EVENT_READ, &event_signal_handler, evb) < 0) {
+            close(fd);
+            pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+            return CMN_ERROR;
+        }
+        evb->sig_fd = fd;
+    }
+
+    evb->sig_mask = mask;
+    evb->sigs[signo].cb = cb;
+    evb->sigs[signo].arg = arg;
+
+    log_debug("signal %d handled by signalfd %d of event base %p", signo,
+              evb->sig_fd, evb);
+
+    return CMN_OK;
+}
+
+int
+event_signal_del(struct event_base *evb, int signo)
+{
+    sigset_t one;
+
+    ASSERT(evb != NULL);
+
+    if (evb->sig_fd < 0 || signo <= 0 || signo >= NSIG ||
+        !sigismember(&evb->sig_mask, signo)) {
+        return CMN_ERROR;
+    }
+
+    sigdelset(&evb->sig_mask, signo);
+    evb->sigs[signo].cb = NULL;
+    evb->sigs[signo].arg = NULL;
+
+    if (signalfd(evb->sig_fd, &evb->sig_mask, SFD_NONBLOCK | SFD_CLOEXEC) < 0) {
+        log_warn("update signalfd %d failed, ignored: %s", evb->sig_fd, strerror(errno));
+    }
+
+    sigemptyset(&one);
+    sigaddset(&one, signo);
+    pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+
+    return CMN_OK;
+}
+
+int
+event_post(struct event_base *evb, event_task_fn fn, void *arg)
+{
+    struct event_task *task;
+    uint64_t one = 1;
+    ssize_t n;
+
+    ASSERT(evb != NULL && fn != NULL);
+
+    task = (struct event_task *)cmn_alloc(sizeof(*task));
+    if (task == NULL) {
+        log_error("task creation failed, %s", strerror(errno));
+        return CMN_ERROR;
+    }
+
+    task->fn = fn;
+    task->arg = arg;
+
+    mpsc_push(&evb->tasks, &task->node);
+
+    /* a loop that is awake runs the task before it sleeps again */
+    if (__atomic_load_n(&evb->sleeping, __ATOMIC_SEQ_CST) &&
+        !__atomic_exchange_n(&evb->wakeup, 1, __ATOMIC_SEQ_CST)) {
+        n = write(evb->post_fd, &one, sizeof(one));
+        if (n < 0 && errno != EAGAIN) {
+            log_error("wake up eventfd %d failed: %s", evb->post_fd, strerror(errno));
+            __atomic_store_n(&evb->wakeup, 0, __ATOMIC_SEQ_CST);
+            return CMN_ERROR;
+        }
+    }
+
+    return CMN_OK;
+}
+
+static int
+_event_backend_wait(struct event_base *evb, int timeout)
+{
+    if (evb->ur != NULL) {
+        return _event_wait_uring(evb, timeout);
+    }
+
+    return _event_wait_epoll(evb, timeout);
+}
+
+/*
+ * poll the backend without sleeping for the current budget, capped by the
+ * wait timeout. returns the # events handled, 0 if the budget ran out, in
+ * which case the time spent is taken off *wait
+ */
+static int
+_event_busy_poll(struct event_base *evb, int *wait)
+{
+    struct event_metrics *m = evb->metrics;
+    int64_t start, now, budget;
+    int n;
+
+    budget = evb->busy_us;
+    if (*wait > 0) {
+        budget = MIN(budget, (int64_t)*wait * 1000);
+    }
+
+    evb->spinning = true;
+    start = now = cmn_usec_mono();
+    do {
+        n = _event_backend_wait(evb, 0);
+        if (n != 0 || !mpsc_empty(&evb->tasks)) {
+            break;
+        }
+        now = cmn_usec_mono();
+    } while (now - start < budget);
+    evb->spinning = false;
+
+    if (n < 0) {
+        return n;
+    }
+
+    if (n > 0 || !mpsc_empty(&evb->tasks)) {
+        evb->busy_us = MIN(evb->busy_us * 2, evb->busy_max);
+        INCR(m, event_busy_hit);
+    } else {
+        evb->busy_us = MAX(evb->busy_us / 2, EVENT_MIN_BUSY);
+        INCR(m, event_busy_miss);
+        if (*wait > 0) {
+            *wait = MAX(*wait - (int)((now - start) / 1000), 0);
+        }
+    }
+
+    if (m != NULL) {
+        INCR_N(m, event_busy_us, cmn_usec_mono() - start);
+        UPDATE_VAL(m, event_busy_budget, evb->busy_us);
+    }
+
+    return n;
+}
+
+/*
+ * create a timed event with event base function and timeout (in millisecond),
+ * the wait is cut short by the nearest pending timer
+ */
+int
+event_wait(struct event_base *evb, int timeout)
+{
+    struct event_metrics *m;
+    int nreturned, wait;
+    int64_t lag;
+
+    ASSERT(evb != NULL);
+
+    m = evb->metrics;
+    if (m != NULL) {
+        evb->t_wait = cmn_usec_mono();
+        if (evb->t_done > 0) {
+            lag = evb->t_wait - evb->t_done;
+            UPDATE_VAL(m, event_loop_lag_us, lag);
+            _event_metric_peak(&m->event_loop_lag_max, lag);
+        }
+        INCR(m, event_wait);
+    }
+
+    wait = timer_wheel_timeout(evb->tw);
+    if (wait < 0 || (timeout >= 0 && timeout < wait)) {
+        wait = timeout;
+    }
+
+    nreturned = 0;
+    if (evb->busy_max > 0 && wait != 0 && mpsc_empty(&evb->tasks)) {
+        nreturned = _event_busy_poll(evb, &wait);
+    }
+
+    if (nreturned == 0) {
+        /*
+         * posters only signal post_fd while the loop sleeps, so announce the
+         * sleep before the last look at the task queue
+         */
+        __atomic_store_n(&evb->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!mpsc_empty(&evb->tasks)) {
+            wait = 0;
+        }
+
+        nreturned = _event_backend_wait(evb, wait);
+
+        __atomic_store_n(&evb->sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+
+    if (nreturned < 0) {
+        return nreturned;
+    }
+
+    nreturned += _event_run_tasks(evb, true);
+
+    timer_wheel_expire(evb->tw);
+
+    if (m != NULL && evb->metrics == m) {
+        evb->t_done = cmn_usec_mono();
+        INCR_N(m, event_cb_us, evb->t_done - evb->t_wake);
+    }
+
+    if (nreturned == 0) {
+        if (wait == -1) {
+           log_error("indefinite wait on event base %p with %d events returned no events", evb,
+                     evb->nevent);
+            return CMN_EEVENT;
+        }
+
+        log_debug("wait on event base %p with nevent %d timeout %d returned no events", evb,
+                  evb->nevent, wait);
+        return CMN_OK;
+    }
+
+    return nreturned;
+}
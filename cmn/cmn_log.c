@@ -1,15 +1,74 @@
 #include "cmn_base.h"
 #include "cmn_log.h"
 
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+/* one formatted line, seq orders the record in the bounded queue (Vyukov) */
+struct log_record {
+    uint64_t seq;
+    int      len;
+    char     buf[LOG_MAX_LEN];
+};
+
+struct log_async {
+    uint64_t          wpos __attribute__((aligned(CMN_CACHELINE_SIZE)));
+    uint64_t          rpos __attribute__((aligned(CMN_CACHELINE_SIZE)));
+    uint64_t          mask;
+    uint64_t          ndrop;        /* # records dropped on a full queue */
+    uint64_t          ndrop_seen;   /* ndrop last reported by the writer */
+    int               sleeping;     /* writer waits on efd */
+    int               efd;          /* wakes the writer */
+    bool              is_stop;
+    pthread_t         tid;
+    pthread_mutex_t   lock;         /* one thread drains at a time */
+    struct log_record *records;
+};
+
 struct logger {
     char name[MAX_FILENAME_LEN];  /* log file name */
     int  level;  /* log level */
     int  fd;     /* log file descriptor */
     int  nerror; /* # log error */
+    struct log_async *async; /* writer thread, NULL if synchronous */
+    uint32_t nrecord;        /* # records of the writer lost on fork, 0 if none */
 };
 
 static struct logger logger;
 
+static void _log_async_stop(struct logger *l);
+
+/* bumped by any thread */
+static inline void
+_log_error(struct logger *l)
+{
+    __atomic_fetch_add(&l->nerror, 1, __ATOMIC_RELAXED);
+}
+
+static inline struct log_async *
+_log_async(struct logger *l)
+{
+    return __atomic_load_n(&l->async, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * the whole of buf in one write, so lines of concurrent threads never
+ * interleave (O_APPEND makes the write atomic on a regular file)
+ */
+static void
+_log_write(struct logger *l, int fd, const char *buf, int len)
+{
+    ssize_t n;
+
+    do {
+        n = cmn_write(fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+
+    if (n != len) {
+        _log_error(l);
+    }
+}
+
 int
 log_open(int level, char *name)
 {
@@ -40,6 +99,8 @@ log_close(void)
 {
     struct logger *l = &logger;
 
+    _log_async_stop(l);
+
     if (l->fd != STDERR_FILENO) {
         close(l->fd);
     }
@@ -51,12 +112,19 @@ log_reopen(void)
     struct logger *l = &logger;
 
     if (l->fd != STDERR_FILENO) {
+        /* the writer must not write to a closed fd */
+        if (l->async != NULL) {
+            pthread_mutex_lock(&l->async->lock);
+        }
         close(l->fd);
         l->fd = open(l->name, O_WRONLY | O_APPEND | O_CREAT, 0644);
         if (l->fd < 0) {
             log_stderr("reopening log file '%s'failed, ignored: %s", l->name,
                        strerror(errno));
         }
+        if (l->async != NULL) {
+            pthread_mutex_unlock(&l->async->lock);
+        }
     }
 }
 
@@ -114,57 +182,463 @@ log_loggable(int level)
     return 1;
 }
 
-static char *
-log_get_time(char *inbuf, int size)
+/* formatted second of this thread, the fraction comes from the monotonic clock */
+struct log_time {
+    int64_t sec;        /* second of buf, -1 if none */
+    int64_t offset;     /* us of the wall clock ahead of the monotonic clock */
+    int     len;        /* length of the second in buf */
+    char    buf[40];
+};
+
+static __thread struct log_time log_time = { .sec = -1 };
+
+static const char *
+log_get_time(void)
 {
-    time_t      now = 0;
-    struct tm   *stime = NULL;
+    struct log_time *t = &log_time;
+    struct timespec ts;
+    struct tm stime;
+    int64_t now, usec;
+    time_t sec;
+    int i;
+
+    now = cmn_usec_mono() + t->offset;
+
+    /* localtime takes the tz lock, so only once a second; resyncs the offset too */
+    if (now / 1000000 != t->sec) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        now = (int64_t)ts.tv_sec * 1000000LL + (int64_t)ts.tv_nsec / 1000;
+        t->offset = now - cmn_usec_mono();
+        t->sec = now / 1000000;
+
+        sec = (time_t)t->sec;
+        localtime_r(&sec, &stime);
+
+        /*ISO 8601: 2019-04-08T15:11:36.123456*/
+        t->len = (int)strftime(t->buf, sizeof(t->buf) - 8, "%Y-%m-%dT%H:%M:%S", &stime);
+        t->buf[t->len] = '.';
+        t->buf[t->len + 7] = '\0';
+    }
 
-    time(&now);
-    stime = localtime(&now);
+    usec = now % 1000000;
+    for (i = 6; i > 0; i--) {
+        t->buf[t->len + i] = (char)('0' + usec % 10);
+        usec /= 10;
+    }
 
-    /*ISO 8601: 2019-04-08T15:11:36+08:00*/
-    strftime(inbuf, size, "%Y-%m-%dT%H:%M:%S", stime);
+    return t->buf;
+}
 
-    return inbuf;
+static struct log_record *
+_log_reserve(struct log_async *a)
+{
+    struct log_record *r;
+    uint64_t pos, seq;
+
+    pos = __atomic_load_n(&a->wpos, __ATOMIC_RELAXED);
+    for (;;) {
+        r = &a->records[pos & a->mask];
+        seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&a->wpos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return r;
+            }
+        } else if ((int64_t)(seq - pos) < 0) {
+            /* the writer has not released this slot yet: full */
+            __atomic_fetch_add(&a->ndrop, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&a->wpos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void
+_log_publish(struct log_async *a, struct log_record *r)
+{
+    uint64_t one = 1;
+
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&a->sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&a->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        if (write(a->efd, &one, sizeof(one)) < 0) {
+            /* the writer wakes up on its own */
+        }
+    }
+}
+
+static inline bool
+_log_ready(struct log_async *a)
+{
+    struct log_record *r = &a->records[a->rpos & a->mask];
+
+    return __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) == a->rpos + 1;
+}
+
+/* write iov out, resubmitting after short writes; returns the # records lost */
+static int
+_log_writev(struct logger *l, struct iovec *iov, int niov)
+{
+    ssize_t n;
+
+    while (niov > 0) {
+        n = writev(l->fd, iov, niov);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return niov;
+        }
+
+        for (; niov > 0 && (size_t)n >= iov->iov_len; iov++, niov--) {
+            n -= (ssize_t)iov->iov_len;
+        }
+
+        if (niov > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+
+    return 0;
+}
+
+/* write out the published records, called with a->lock held */
+static int
+_log_drain(struct logger *l, struct log_async *a)
+{
+    struct iovec iov[LOG_ASYNC_BATCH];
+    struct log_record *r;
+    uint64_t ndrop;
+    int niov, i, total = 0;
+    char buf[64];
+    ssize_t n;
+
+    for (;;) {
+        for (niov = 0; niov < LOG_ASYNC_BATCH; niov++) {
+            r = &a->records[(a->rpos + (uint64_t)niov) & a->mask];
+            if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != a->rpos + (uint64_t)niov + 1) {
+                break;
+            }
+            iov[niov].iov_base = r->buf;
+            iov[niov].iov_len = (size_t)r->len;
+        }
+
+        if (niov == 0) {
+            break;
+        }
+
+        n = _log_writev(l, iov, niov);
+        if (n > 0) {
+            __atomic_fetch_add(&l->nerror, (int)n, __ATOMIC_RELAXED);
+        }
+
+        for (i = 0; i < niov; i++) {
+            r = &a->records[a->rpos & a->mask];
+            __atomic_store_n(&r->seq, a->rpos + a->mask + 1, __ATOMIC_RELEASE);
+            a->rpos++;
+        }
+
+        total += niov;
+    }
+
+    ndrop = __atomic_load_n(&a->ndrop, __ATOMIC_RELAXED);
+    if (ndrop != a->ndrop_seen) {
+        n = cmn_scnprintf(buf, sizeof(buf), "log queue full, %llu records dropped\n",
+                          (unsigned long long)(ndrop - a->ndrop_seen));
+        _log_write(l, l->fd, buf, (int)n);
+        a->ndrop_seen = ndrop;
+    }
+
+    return total;
+}
+
+static void *
+_log_writer(void *arg)
+{
+    struct logger *l = &logger;
+    struct log_async *a = arg;
+    struct pollfd pfd;
+    uint64_t cnt;
+
+    pfd.fd = a->efd;
+    pfd.events = POLLIN;
+
+    while (!__atomic_load_n(&a->is_stop, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&a->lock);
+        _log_drain(l, a);
+        pthread_mutex_unlock(&a->lock);
+
+        __atomic_store_n(&a->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (_log_ready(a)) {
+            __atomic_store_n(&a->sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        /* a record published halfway through the check is picked up on timeout */
+        if (poll(&pfd, 1, LOG_ASYNC_WAIT) > 0 && read(a->efd, &cnt, sizeof(cnt)) < 0) {
+            _log_error(l);
+        }
+        __atomic_store_n(&a->sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+
+    return NULL;
+}
+
+/*
+ * the writer thread is gone in a forked child, which logs synchronously
+ * until it calls log_async_child; the ring is the parent's to drain
+ */
+static void
+_log_atfork_child(void)
+{
+    struct logger *l = &logger;
+    struct log_async *a = l->async;
+
+    if (a == NULL) {
+        return;
+    }
+
+    l->async = NULL;
+    l->nrecord = (uint32_t)(a->mask + 1);
+
+    close(a->efd);
+    cmn_free(a->records);
+    cmn_free(a);
+}
+
+static void
+_log_register_atfork(void)
+{
+    if (pthread_atfork(NULL, NULL, _log_atfork_child) != 0) {
+        log_stderr("log fork handler registration failed");
+    }
+}
+
+int
+log_async(uint32_t nrecord)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    struct logger *l = &logger;
+    struct log_async *a;
+    sigset_t mask, omask;
+    uint64_t cap, i;
+    int status;
+
+    if (l->async != NULL) {
+        return CMN_OK;
+    }
+
+    status = pthread_once(&once, _log_register_atfork);
+    if (status != 0) {
+        log_stderr("log fork handler registration failed: %s", strerror(status));
+        return CMN_ERROR;
+    }
+
+    cap = 1;
+    while (cap < (nrecord > 0 ? nrecord : LOG_ASYNC_NRECORD)) {
+        cap <<= 1;
+    }
+
+    a = (struct log_async *)cmn_zalloc(sizeof(*a));
+    if (a == NULL) {
+        return CMN_ERROR;
+    }
+
+    a->records = (struct log_record *)cmn_alloc(sizeof(*a->records) * cap);
+    if (a->records == NULL) {
+        cmn_free(a);
+        return CMN_ERROR;
+    }
+
+    for (i = 0; i < cap; i++) {
+        a->records[i].seq = i;
+    }
+    a->mask = cap - 1;
+
+    a->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (a->efd < 0) {
+        log_stderr("log writer eventfd failed: %s", strerror(errno));
+        goto error;
+    }
+
+    pthread_mutex_init(&a->lock, NULL);
+
+    /* signals go to the threads that handle them, never to the writer */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &omask);
+    status = pthread_create(&a->tid, NULL, _log_writer, a);
+    pthread_sigmask(SIG_SETMASK, &omask, NULL);
+    if (status != 0) {
+        log_stderr("log writer thread create failed: %s", strerror(status));
+        pthread_mutex_destroy(&a->lock);
+        close(a->efd);
+        goto error;
+    }
+
+    l->nrecord = 0;
+    __atomic_store_n(&l->async, a, __ATOMIC_RELEASE);
+
+    return CMN_OK;
+
+error:
+    cmn_free(a->records);
+    cmn_free(a);
+    return CMN_ERROR;
+}
+
+int
+log_async_child(void)
+{
+    struct logger *l = &logger;
+
+    if (l->nrecord == 0) {
+        return CMN_OK;
+    }
+
+    return log_async(l->nrecord);
+}
+
+void
+log_flush(void)
+{
+    struct logger *l = &logger;
+    struct log_async *a = _log_async(l);
+
+    if (a == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    _log_drain(l, a);
+    pthread_mutex_unlock(&a->lock);
+}
+
+uint64_t
+log_dropped(void)
+{
+    struct logger *l = &logger;
+    struct log_async *a = _log_async(l);
+
+    return a != NULL ? __atomic_load_n(&a->ndrop, __ATOMIC_RELAXED) : 0;
+}
+
+static void
+_log_async_stop(struct logger *l)
+{
+    struct log_async *a = l->async;
+    uint64_t one = 1;
+
+    if (a == NULL) {
+        return;
+    }
+
+    /* new lines go out synchronously, the queued ones are drained below */
+    __atomic_store_n(&l->async, NULL, __ATOMIC_RELEASE);
+    l->nrecord = 0;
+
+    __atomic_store_n(&a->is_stop, true, __ATOMIC_RELEASE);
+    if (write(a->efd, &one, sizeof(one)) < 0) {
+        /* the writer stops on its next timeout */
+    }
+    pthread_join(a->tid, NULL);
+
+    _log_drain(l, a);
+
+    pthread_mutex_destroy(&a->lock);
+    close(a->efd);
+    cmn_free(a->records);
+    cmn_free(a);
+}
+
+static int
+_log_format(char *buf, int size, const char *file, char *func, int line, int level,
+            int is_head, const char *fmt, va_list args)
+{
+    int len = 0;
+
+    if (is_head) {
+        len += cmn_scnprintf(buf + len, size - len, "[%s %d %X %s:%d %s() %s]",
+            log_get_time(), getpid(), pthread_self(), file, line, func, log_level2str(level));
+    }
+
+    len += cmn_vscnprintf(buf + len, size - len, fmt, args);
+
+    buf[len++] = '\n';
+
+    return len;
+}
+
+/* queue buf of len bytes in records, split at line ends */
+static void
+_log_emit_async(struct log_async *a, const char *buf, int len)
+{
+    struct log_record *r;
+    const char *nl;
+    int n;
+
+    while (len > 0) {
+        n = len;
+        if (n > LOG_MAX_LEN) {
+            nl = memrchr(buf, '\n', LOG_MAX_LEN);
+            n = nl != NULL ? (int)(nl - buf) + 1 : LOG_MAX_LEN;
+        }
+
+        r = _log_reserve(a);
+        if (r != NULL) {
+            memcpy(r->buf, buf, n);
+            r->len = n;
+            _log_publish(a, r);
+        }
+
+        buf += n;
+        len -= n;
+    }
 }
 
 void
 _log(const char *file, char *func, int line, int panic, int level, int is_head, const char *fmt, ...)
 {
     struct logger *l = &logger;
-    int len, size, errno_save;
-    static char buf[LOG_MAX_LEN] = {0};
-    static char datetime[64] = {0};
+    struct log_async *a = _log_async(l);
+    struct log_record *r;
+    int len, errno_save;
+    static __thread char buf[LOG_MAX_LEN];
     va_list args;
-    ssize_t n = 0;
 
     if (l->fd < 0) {
         return;
     }
 
     errno_save = errno;
-    len = 0;            /* length of output buffer */
-    size = LOG_MAX_LEN; /* size of output buffer */
-
-    if (is_head) {
-        log_get_time(datetime, sizeof(datetime));
 
-        len += cmn_scnprintf(buf + len, size - len, "[%s %d %X %s:%d %s() %s]",
-            datetime, getpid(), pthread_self(), file, line, func, log_level2str(level));
+    /* formatted in place, a panic is written behind whatever is queued */
+    if (a != NULL && !panic) {
+        r = _log_reserve(a);
+        if (r != NULL) {
+            va_start(args, fmt);
+            r->len = _log_format(r->buf, LOG_MAX_LEN, file, func, line, level, is_head,
+                                 fmt, args);
+            va_end(args);
+            _log_publish(a, r);
+        }
+        errno = errno_save;
+        return;
     }
 
     va_start(args, fmt);
-    len += cmn_vscnprintf(buf + len, size - len, fmt, args);
+    len = _log_format(buf, LOG_MAX_LEN, file, func, line, level, is_head, fmt, args);
     va_end(args);
 
-    buf[len++] = '\n';
-
-    n = cmn_write(l->fd, buf, len);
-    if (n < 0) {
-        l->nerror++;
+    if (a != NULL) {
+        log_flush();
     }
 
+    _log_write(l, l->fd, buf, len);
+
     errno = errno_save;
 
     if (panic) {
@@ -177,9 +651,8 @@ _log_stderr(const char *fmt, ...)
 {
     struct logger *l = &logger;
     int len, size, errno_save;
-    static char buf[4 * LOG_MAX_LEN] = {0};
+    static __thread char buf[4 * LOG_MAX_LEN];
     va_list args;
-    ssize_t n;
 
     errno_save = errno;
     len = 0;                /* length of output buffer */
@@ -191,10 +664,7 @@ _log_stderr(const char *fmt, ...)
 
     buf[len++] = '\n';
 
-    n = cmn_write(STDERR_FILENO, buf, len);
-    if (n < 0) {
-        l->nerror++;
-    }
+    _log_write(l, STDERR_FILENO, buf, len);
 
     errno = errno_save;
 }
@@ -207,26 +677,27 @@ void
 _log_hexdump(const char *file, int line, int level, char *data, int datalen, const char *fmt, ...)
 {
     struct logger *l = &logger;
+    struct log_async *a;
     char buf[8 * LOG_MAX_LEN];
     int i, off, len, size, errno_save;
     va_list args;
-    ssize_t n;
 
     if (l->fd < 0) {
         return;
     }
 
-    /* log format */
-    va_start(args, fmt);
-    _log(file, "-", line, 0, level, false, fmt);
-    va_end(args);
-
-    /* log hexdump */
     errno_save = errno;
     off = 0;                  /* data offset */
     len = 0;                  /* length of output buffer */
     size = 8 * LOG_MAX_LEN;   /* size of output buffer */
 
+    /* log format, emitted with the dump */
+    va_start(args, fmt);
+    len = _log_format(buf, LOG_MAX_LEN, file, "-", line, level, false, fmt, args);
+    va_end(args);
+
+    /* log hexdump */
+
     while (datalen != 0 && (len < size - 1)) {
         char *save, *str;
         unsigned char c;
@@ -261,10 +732,14 @@ _log_hexdump(const char *file, int line, int level, char *data, int datalen, con
         off += 16;
     }
 
-    n = cmn_write(l->fd, buf, len);
-    if (n < 0) {
-        l->nerror++;
+    a = _log_async(l);
+    if (a != NULL) {
+        _log_emit_async(a, buf, len);
+        errno = errno_save;
+        return;
     }
 
+    _log_write(l, l->fd, buf, len);
+
     errno = errno_save;
 }
@@ -0,0 +1,248 @@
+#include "cmn_base.h"
+#include "cmn_log.h"
+#include "cmn_reactor.h"
+
+#include <sched.h>
+
+static __thread struct reactor *reactor_current = NULL;
+
+struct reactor *
+reactor_self(void)
+{
+    return reactor_current;
+}
+
+#define REACTOR_ACCEPT_BATCH    64      /* max # connections per accept batch */
+
+static void
+_reactor_accept(void *arg, uint32_t events)
+{
+    struct reactor *r = arg;
+    struct sock_conn *c;
+    int sd[REACTOR_ACCEPT_BATCH];
+    int i, n;
+
+    do {
+        n = sock_accept_batch(&r->listener, sd, REACTOR_ACCEPT_BATCH);
+
+        for (i = 0; i < n; i++) {
+            c = sock_conn_pool_get(r->conns, false, NULL);
+            if (c == NULL) {
+                close(sd[i]);
+                continue;
+            }
+
+            c->sd = sd[i];
+            r->naccept++;
+            r->group->accept(r, c);
+        }
+    } while (n == REACTOR_ACCEPT_BATCH);
+}
+
+static const struct event_handler reactor_listen_handler = {
+    .read  = _reactor_accept,
+    .write = NULL,
+    .error = NULL,
+};
+
+static void
+_reactor_wakeup(void *arg)
+{
+}
+
+static void *
+_reactor_loop(void *arg)
+{
+    struct reactor *r = arg;
+    struct reactor_group *g = r->group;
+    cpu_set_t cpus;
+    int status;
+
+    reactor_current = r;
+
+    if (r->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(r->cpu, &cpus);
+
+        status = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (status != 0) {
+            log_warn("pin reactor %d to cpu %d failed, ignored: %s", r->id, r->cpu,
+                     strerror(status));
+        }
+    }
+
+    log_info("reactor %d running on cpu %d with listen sd %d", r->id, r->cpu,
+             r->listener.sd);
+
+    while (!__atomic_load_n(&g->is_stop, __ATOMIC_ACQUIRE)) {
+        status = event_wait(r->evb, -1);
+        if (status == CMN_ERROR) {
+            log_error("reactor %d wait failed, stopped", r->id);
+            break;
+        }
+    }
+
+    reactor_current = NULL;
+
+    return NULL;
+}
+
+struct reactor_group *
+reactor_group_create(int nreactor, int nevent, struct addrinfo *ai, int max_backlog,
+                     event_cb_fn cb, reactor_accept_fn accept, void *data)
+{
+    struct reactor_group *g;
+    struct reactor *r;
+    long ncpu;
+    int i;
+
+    ASSERT(nreactor > 0 && ai != NULL && accept != NULL);
+
+    g = (struct reactor_group *)cmn_zalloc(sizeof(*g));
+    if (g == NULL) {
+        log_error("reactor group creation failed, %s", strerror(errno));
+        return NULL;
+    }
+
+    g->reactors = (struct reactor *)cmn_calloc(nreactor, sizeof(struct reactor));
+    if (g->reactors == NULL) {
+        log_error("creation of %d reactors failed, %s", nreactor, strerror(errno));
+        cmn_free(g);
+        return NULL;
+    }
+
+    g->nreactor = nreactor;
+    g->is_stop = 0;
+    g->cb = cb;
+    g->accept = accept;
+    g->data = data;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (i = 0; i < nreactor; i++) {
+        r = &g->reactors[i];
+        r->id = i;
+        r->cpu = ncpu > 0 ? (int)(i % ncpu) : -1;
+        r->group = g;
+        r->listener.sd = -1;
+        r->listener.is_listen = true;
+        r->listener.data = r;
+    }
+
+    for (i = 0; i < nreactor; i++) {
+        r = &g->reactors[i];
+
+        r->evb = event_base_create(nevent, cb);
+        if (r->evb == NULL) {
+            goto error;
+        }
+
+        /* one slab up front, no bound: the accept path never mallocs in steady state */
+        r->conns = sock_conn_pool_create(1, 0, 0, 0);
+        if (r->conns == NULL) {
+            goto error;
+        }
+
+        if (!sock_listen_reuseport(ai, &r->listener, max_backlog)) {
+            r->listener.sd = -1;
+            goto error;
+        }
+
+        if (event_register(r->evb, r->listener.sd, EVENT_READ, &reactor_listen_handler, r) < 0) {
+            goto error;
+        }
+    }
+
+    return g;
+
+error:
+    log_error("reactor %d setup failed", i);
+    reactor_group_destroy(&g);
+    return NULL;
+}
+
+void
+reactor_group_destroy(struct reactor_group **group)
+{
+    struct reactor_group *g = *group;
+    struct reactor *r;
+    int i;
+
+    if (g == NULL) {
+        return;
+    }
+
+    reactor_group_stop(g);
+
+    for (i = 0; i < g->nreactor; i++) {
+        r = &g->reactors[i];
+
+        if (r->listener.sd >= 0) {
+            if (r->evb != NULL) {
+                event_del(r->evb, r->listener.sd);
+            }
+            sock_close(&r->listener);
+            r->listener.sd = -1;
+        }
+
+        event_base_destroy(&r->evb);
+        sock_conn_pool_destroy(&r->conns);
+    }
+
+    cmn_free(g->reactors);
+    cmn_free(g);
+    *group = NULL;
+}
+
+int
+reactor_group_start(struct reactor_group *g)
+{
+    struct reactor *r;
+    int i, status;
+
+    ASSERT(g != NULL);
+
+    __atomic_store_n(&g->is_stop, 0, __ATOMIC_RELEASE);
+
+    for (i = 0; i < g->nreactor; i++) {
+        r = &g->reactors[i];
+
+        status = pthread_create(&r->tid, NULL, _reactor_loop, r);
+        if (status != 0) {
+            log_error("start reactor %d failed: %s", i, strerror(status));
+            reactor_group_stop(g);
+            return CMN_ERROR;
+        }
+        r->is_running = true;
+    }
+
+    return CMN_OK;
+}
+
+void
+reactor_group_stop(struct reactor_group *g)
+{
+    struct reactor *r;
+    int i;
+
+    ASSERT(g != NULL);
+
+    __atomic_store_n(&g->is_stop, 1, __ATOMIC_RELEASE);
+
+    for (i = 0; i < g->nreactor; i++) {
+        r = &g->reactors[i];
+
+        if (r->is_running) {
+            event_post(r->evb, _reactor_wakeup, r);
+        }
+    }
+
+    for (i = 0; i < g->nreactor; i++) {
+        r = &g->reactors[i];
+
+        if (r->is_running) {
+            pthread_join(r->tid, NULL);
+            r->is_running = false;
+        }
+    }
+}
@@ -0,0 +1,530 @@
+#include "cmn_base.h"
+#include "cmn_log.h"
+#include "cmn_hash.h"
+#include "cmn_queue.h"
+#include "cmn_resolve.h"
+
+#define RESOLVE_NBUCKET     1024    /* # hash buckets of the cache */
+
+struct resolve_entry {
+    TAILQ_ENTRY(resolve_entry) hlink;   /* bucket link */
+    TAILQ_ENTRY(resolve_entry) lru;     /* lru link, most recent first */
+    uint32_t                   hash;
+    int                        port;
+    bool                       is_ipv4;
+    int                        status;  /* CMN_OK or CMN_ERROR (negative entry) */
+    int64_t                    expire;  /* ms (monotonic) the entry is valid until */
+    struct sock_addr           sa;
+    char                       name[MAX_HOSTNAME_LEN];
+};
+
+TAILQ_HEAD(resolve_list, resolve_entry);
+
+struct resolve_req {
+    STAILQ_ENTRY(resolve_req)  link;    /* waiter link */
+    struct event_base          *evb;    /* loop completing the request */
+    resolve_fn                 cb;
+    void                       *arg;
+    int                        status;
+    struct sock_addr           sa;
+};
+
+STAILQ_HEAD(resolve_waiters, resolve_req);
+
+/* one lookup in flight, every request for its key waits on it */
+struct resolve_flight {
+    STAILQ_ENTRY(resolve_flight) link;  /* pending queue link */
+    TAILQ_ENTRY(resolve_flight)  hlink; /* bucket link */
+    uint32_t                     hash;
+    int                          port;
+    bool                         is_ipv4;
+    struct resolve_waiters       waiters;
+    char                         name[MAX_HOSTNAME_LEN];
+};
+
+STAILQ_HEAD(resolve_queue, resolve_flight);
+TAILQ_HEAD(resolve_flights, resolve_flight);
+
+/* cache, guarded by resolve_lock */
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool resolve_is_init = false;
+static struct resolve_list resolve_bucket[RESOLVE_NBUCKET];
+static struct resolve_list resolve_lru;
+static uint32_t resolve_nentry = 0;
+static uint32_t resolve_max_entry = RESOLVE_MAX_ENTRY;
+static int64_t resolve_ttl = RESOLVE_TTL;
+static int64_t resolve_neg_ttl = RESOLVE_NEG_TTL;
+
+/* helper threads, guarded by resolve_qlock */
+static pthread_mutex_t resolve_qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_qcond = PTHREAD_COND_INITIALIZER;
+static struct resolve_queue resolve_pending = STAILQ_HEAD_INITIALIZER(resolve_pending);
+static struct resolve_flights resolve_flight_bucket[RESOLVE_NBUCKET];
+static pthread_t *resolve_threads = NULL;
+static int resolve_nthread = 0;
+static bool resolve_is_stop = false;
+
+static inline int64_t
+_resolve_now(void)
+{
+    return cmn_usec_mono() / 1000;
+}
+
+static void
+_resolve_init(void)
+{
+    int i;
+
+    if (resolve_is_init) {
+        return;
+    }
+
+    for (i = 0; i < RESOLVE_NBUCKET; i++) {
+        TAILQ_INIT(&resolve_bucket[i]);
+    }
+    TAILQ_INIT(&resolve_lru);
+    resolve_nentry = 0;
+    resolve_is_init = true;
+}
+
+static uint32_t
+_resolve_hash(const char *name, int port, bool is_ipv4)
+{
+    uint32_t hash;
+
+    hash_murmur3_32(name, (int)strlen(name), (uint32_t)port, &hash);
+
+    return is_ipv4 ? hash : ~hash;
+}
+
+static void
+_resolve_remove(struct resolve_entry *e)
+{
+    TAILQ_REMOVE(&resolve_bucket[e->hash % RESOLVE_NBUCKET], e, hlink);
+    TAILQ_REMOVE(&resolve_lru, e, lru);
+    resolve_nentry--;
+    cmn_free(e);
+}
+
+/* evict least recently used entries down to n; call with resolve_lock held */
+static void
+_resolve_trim(uint32_t n)
+{
+    while (resolve_nentry > n) {
+        _resolve_remove(TAILQ_LAST(&resolve_lru, resolve_list));
+    }
+}
+
+/* entry of the key, NULL if missing or expired; call with resolve_lock held */
+static struct resolve_entry *
+_resolve_find(const char *name, int port, bool is_ipv4, uint32_t hash)
+{
+    struct resolve_entry *e;
+
+    TAILQ_FOREACH(e, &resolve_bucket[hash % RESOLVE_NBUCKET], hlink) {
+        if (e->hash == hash && e->port == port && e->is_ipv4 == is_ipv4 &&
+            strcmp(e->name, name) == 0) {
+            break;
+        }
+    }
+
+    if (e != NULL && e->expire <= _resolve_now()) {
+        _resolve_remove(e);
+        e = NULL;
+    }
+
+    return e;
+}
+
+static void
+_resolve_insert(const char *name, int port, bool is_ipv4, int status,
+                struct sock_addr *sa)
+{
+    struct resolve_entry *e;
+    uint32_t hash;
+
+    if (strlen(name) >= MAX_HOSTNAME_LEN || resolve_max_entry == 0) {
+        return;
+    }
+
+    hash = _resolve_hash(name, port, is_ipv4);
+
+    pthread_mutex_lock(&resolve_lock);
+
+    _resolve_init();
+
+    e = _resolve_find(name, port, is_ipv4, hash);
+    if (e == NULL) {
+        _resolve_trim(resolve_max_entry > 0 ? resolve_max_entry - 1 : 0);
+
+        e = (struct resolve_entry *)cmn_alloc(sizeof(*e));
+        if (e == NULL) {
+            pthread_mutex_unlock(&resolve_lock);
+            return;
+        }
+
+        e->hash = hash;
+        e->port = port;
+        e->is_ipv4 = is_ipv4;
+        strcpy(e->name, name);
+        TAILQ_INSERT_HEAD(&resolve_bucket[hash % RESOLVE_NBUCKET], e, hlink);
+        resolve_nentry++;
+    } else {
+        TAILQ_REMOVE(&resolve_lru, e, lru);
+    }
+    TAILQ_INSERT_HEAD(&resolve_lru, e, lru);
+
+    e->status = status;
+    e->expire = _resolve_now() + (status == CMN_OK ? resolve_ttl : resolve_neg_ttl);
+    if (status == CMN_OK) {
+        e->sa = *sa;
+    }
+
+    pthread_mutex_unlock(&resolve_lock);
+}
+
+int
+resolve_lookup(const char *name, int port, bool is_ipv4, struct sock_addr *sa)
+{
+    struct resolve_entry *e;
+    uint32_t hash;
+    int status;
+
+    name = name != NULL ? name : "";
+    hash = _resolve_hash(name, port, is_ipv4);
+
+    pthread_mutex_lock(&resolve_lock);
+
+    _resolve_init();
+
+    e = _resolve_find(name, port, is_ipv4, hash);
+    if (e == NULL) {
+        pthread_mutex_unlock(&resolve_lock);
+        return CMN_NOKEY;
+    }
+
+    TAILQ_REMOVE(&resolve_lru, e, lru);
+    TAILQ_INSERT_HEAD(&resolve_lru, e, lru);
+
+    status = e->status;
+    if (status == CMN_OK) {
+        *sa = e->sa;
+    }
+
+    pthread_mutex_unlock(&resolve_lock);
+
+    return status;
+}
+
+int
+resolve_cached(const char *name, int port, bool is_ipv4, struct sock_addr *sa)
+{
+    int status;
+
+    status = resolve_lookup(name, port, is_ipv4, sa);
+    if (status != CMN_NOKEY) {
+        return status;
+    }
+
+    status = sock_resolve(name != NULL && name[0] != '\0' ? name : NULL, port, sa,
+                          is_ipv4);
+    _resolve_insert(name != NULL ? name : "", port, is_ipv4, status, sa);
+
+    return status;
+}
+
+/* numeric addresses need no resolver */
+static bool
+_resolve_numeric(const char *name, int port, bool is_ipv4, struct sock_addr *sa)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)&sa->addr;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&sa->addr;
+
+    if (name == NULL) {
+        return false;
+    }
+
+    memset(sa, 0, sizeof(*sa));
+    sa->socktype = SOCK_STREAM;
+    sa->protocol = IPPROTO_TCP;
+
+    if (inet_pton(AF_INET, name, &sin->sin_addr) == 1) {
+        sa->family = sin->sin_family = AF_INET;
+        sin->sin_port = htons((uint16_t)port);
+        sa->addrlen = sizeof(*sin);
+        return true;
+    }
+
+    if (!is_ipv4 && inet_pton(AF_INET6, name, &sin6->sin6_addr) == 1) {
+        sa->family = sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons((uint16_t)port);
+        sa->addrlen = sizeof(*sin6);
+        return true;
+    }
+
+    return false;
+}
+
+static void
+_resolve_done(void *arg)
+{
+    struct resolve_req *req = arg;
+
+    req->cb(req->status, req->status == CMN_OK ? &req->sa : NULL, req->arg);
+    cmn_free(req);
+}
+
+/* in-flight lookup of the key, NULL if none; call with resolve_qlock held */
+static struct resolve_flight *
+_resolve_flight_find(const char *name, int port, bool is_ipv4, uint32_t hash)
+{
+    struct resolve_flight *f;
+
+    TAILQ_FOREACH(f, &resolve_flight_bucket[hash % RESOLVE_NBUCKET], hlink) {
+        if (f->hash == hash && f->port == port && f->is_ipv4 == is_ipv4 &&
+            strcmp(f->name, name) == 0) {
+            return f;
+        }
+    }
+
+    return NULL;
+}
+
+static void *
+_resolve_loop(void *arg)
+{
+    struct resolve_flight *f;
+    struct resolve_waiters waiters;
+    struct resolve_req *req;
+    struct sock_addr sa;
+    int status;
+
+    for (;;) {
+        pthread_mutex_lock(&resolve_qlock);
+        while (STAILQ_EMPTY(&resolve_pending) && !resolve_is_stop) {
+            pthread_cond_wait(&resolve_qcond, &resolve_qlock);
+        }
+        if (resolve_is_stop) {
+            pthread_mutex_unlock(&resolve_qlock);
+            break;
+        }
+        f = STAILQ_FIRST(&resolve_pending);
+        STAILQ_REMOVE_HEAD(&resolve_pending, link);
+        pthread_mutex_unlock(&resolve_qlock);
+
+        status = resolve_cached(f->name, f->port, f->is_ipv4, &sa);
+
+        /* the answer is cached, later requests no longer need the flight */
+        pthread_mutex_lock(&resolve_qlock);
+        TAILQ_REMOVE(&resolve_flight_bucket[f->hash % RESOLVE_NBUCKET], f, hlink);
+        STAILQ_INIT(&waiters);
+        STAILQ_CONCAT(&waiters, &f->waiters);
+        pthread_mutex_unlock(&resolve_qlock);
+
+        while ((req = STAILQ_FIRST(&waiters)) != NULL) {
+            STAILQ_REMOVE_HEAD(&waiters, link);
+            req->status = status;
+            req->sa = sa;
+            if (event_post(req->evb, _resolve_done, req) != CMN_OK) {
+                log_error("complete resolve of '%s' failed, dropped", f->name);
+                cmn_free(req);
+            }
+        }
+
+        cmn_free(f);
+    }
+
+    return NULL;
+}
+
+/* call with resolve_qlock held */
+static int
+_resolve_start(int nthread)
+{
+    sigset_t mask, omask;
+    int i, status;
+
+    resolve_threads = (pthread_t *)cmn_calloc(nthread, sizeof(pthread_t));
+    if (resolve_threads == NULL) {
+        log_error("resolver threads creation failed: %s", strerror(errno));
+        return CMN_ERROR;
+    }
+
+    resolve_is_stop = false;
+
+    for (i = 0; i < RESOLVE_NBUCKET; i++) {
+        TAILQ_INIT(&resolve_flight_bucket[i]);
+    }
+
+    /* signals go to the threads that handle them, never to a helper */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &omask);
+
+    for (i = 0; i < nthread; i++) {
+        status = pthread_create(&resolve_threads[i], NULL, _resolve_loop, NULL);
+        if (status != 0) {
+            log_error("resolver thread %d creation failed: %s", i, strerror(status));
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+    resolve_nthread = i;
+    if (i == 0) {
+        cmn_free(resolve_threads);
+        return CMN_ERROR;
+    }
+
+    return CMN_OK;
+}
+
+int
+resolve_setup(int64_t ttl, int64_t neg_ttl, uint32_t max_entry, int nthread)
+{
+    int status;
+
+    pthread_mutex_lock(&resolve_lock);
+    resolve_ttl = ttl;
+    resolve_neg_ttl = neg_ttl;
+    resolve_max_entry = max_entry;
+    _resolve_init();
+    _resolve_trim(max_entry);
+    pthread_mutex_unlock(&resolve_lock);
+
+    pthread_mutex_lock(&resolve_qlock);
+    if (resolve_nthread > 0) {
+        pthread_mutex_unlock(&resolve_qlock);
+        log_error("resolver already running with %d threads", resolve_nthread);
+        return CMN_ERROR;
+    }
+    status = _resolve_start(nthread > 0 ? nthread : RESOLVE_NTHREAD);
+    pthread_mutex_unlock(&resolve_qlock);
+
+    return status;
+}
+
+void
+resolve_teardown(void)
+{
+    struct resolve_flight *f;
+    struct resolve_req *req;
+    struct resolve_entry *e;
+    int i, n;
+
+    pthread_mutex_lock(&resolve_qlock);
+    resolve_is_stop = true;
+    n = resolve_nthread;
+    pthread_cond_broadcast(&resolve_qcond);
+    pthread_mutex_unlock(&resolve_qlock);
+
+    for (i = 0; i < n; i++) {
+        pthread_join(resolve_threads[i], NULL);
+    }
+
+    pthread_mutex_lock(&resolve_qlock);
+    while ((f = STAILQ_FIRST(&resolve_pending)) != NULL) {
+        STAILQ_REMOVE_HEAD(&resolve_pending, link);
+        TAILQ_REMOVE(&resolve_flight_bucket[f->hash % RESOLVE_NBUCKET], f, hlink);
+        log_warn("resolve of '%s' dropped by teardown", f->name);
+        while ((req = STAILQ_FIRST(&f->waiters)) != NULL) {
+            STAILQ_REMOVE_HEAD(&f->waiters, link);
+            cmn_free(req);
+        }
+        cmn_free(f);
+    }
+    if (resolve_threads != NULL) {
+        cmn_free(resolve_threads);
+    }
+    resolve_nthread = 0;
+    pthread_mutex_unlock(&resolve_qlock);
+
+    pthread_mutex_lock(&resolve_lock);
+    if (resolve_is_init) {
+        while ((e = TAILQ_FIRST(&resolve_lru)) != NULL) {
+            _resolve_remove(e);
+        }
+    }
+    resolve_ttl = RESOLVE_TTL;
+    resolve_neg_ttl = RESOLVE_NEG_TTL;
+    resolve_max_entry = RESOLVE_MAX_ENTRY;
+    pthread_mutex_unlock(&resolve_lock);
+}
+
+int
+resolve_async(struct event_base *evb, const char *name, int port, bool is_ipv4,
+              resolve_fn cb, void *arg)
+{
+    struct resolve_flight *f;
+    struct resolve_req *req;
+    struct sock_addr sa;
+    uint32_t hash;
+    int status;
+
+    ASSERT(evb != NULL && cb != NULL);
+
+    if (_resolve_numeric(name, port, is_ipv4, &sa)) {
+        cb(CMN_OK, &sa, arg);
+        return CMN_OK;
+    }
+
+    status = resolve_lookup(name, port, is_ipv4, &sa);
+    if (status != CMN_NOKEY) {
+        cb(status, status == CMN_OK ? &sa : NULL, arg);
+        return CMN_OK;
+    }
+
+    if (name != NULL && strlen(name) >= MAX_HOSTNAME_LEN) {
+        log_error("resolve of name with %zu chars failed: too long", strlen(name));
+        return CMN_ERROR;
+    }
+
+    req = (struct resolve_req *)cmn_alloc(sizeof(*req));
+    if (req == NULL) {
+        log_error("resolve request creation failed: %s", strerror(errno));
+        return CMN_ERROR;
+    }
+
+    req->evb = evb;
+    req->cb = cb;
+    req->arg = arg;
+    req->status = CMN_ERROR;
+
+    name = name != NULL ? name : "";
+    hash = _resolve_hash(name, port, is_ipv4);
+
+    pthread_mutex_lock(&resolve_qlock);
+
+    if (resolve_nthread == 0 && _resolve_start(RESOLVE_NTHREAD) != CMN_OK) {
+        pthread_mutex_unlock(&resolve_qlock);
+        cmn_free(req);
+        return CMN_ERROR;
+    }
+
+    /* a storm for one name makes one getaddrinfo call */
+    f = _resolve_flight_find(name, port, is_ipv4, hash);
+    if (f == NULL) {
+        f = (struct resolve_flight *)cmn_alloc(sizeof(*f));
+        if (f == NULL) {
+            pthread_mutex_unlock(&resolve_qlock);
+            log_error("resolve request creation failed: %s", strerror(errno));
+            cmn_free(req);
+            return CMN_ERROR;
+        }
+
+        f->hash = hash;
+        f->port = port;
+        f->is_ipv4 = is_ipv4;
+        strcpy(f->name, name);
+        STAILQ_INIT(&f->waiters);
+        TAILQ_INSERT_HEAD(&resolve_flight_bucket[hash % RESOLVE_NBUCKET], f, hlink);
+        STAILQ_INSERT_TAIL(&resolve_pending, f, link);
+        pthread_cond_signal(&resolve_qcond);
+    }
+
+    STAILQ_INSERT_TAIL(&f->waiters, req, link);
+
+    pthread_mutex_unlock(&resolve_qlock);
+
+    return CMN_OK;
+}
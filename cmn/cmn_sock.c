@@ -1,4 +1,80 @@
 #include "cmn_sock.h"
+#include "cmn_event.h"
+
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+#ifndef SOL_UDP
+# define SOL_UDP        17
+#endif
+
+#ifndef UDP_SEGMENT
+# define UDP_SEGMENT    103
+#endif
+
+#ifndef UDP_GRO
+# define UDP_GRO        104
+#endif
+
+#ifndef SO_ZEROCOPY
+# define SO_ZEROCOPY    60
+#endif
+
+#ifndef MSG_ZEROCOPY
+# define MSG_ZEROCOPY   0x4000000
+#endif
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+# define SO_EE_ORIGIN_ZEROCOPY          5
+#endif
+
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+# define SO_EE_CODE_ZEROCOPY_COPIED     1
+#endif
+
+#ifndef TCP_FASTOPEN_CONNECT
+# define TCP_FASTOPEN_CONNECT   30
+#endif
+
+#ifndef TCP_NOTSENT_LOWAT
+# define TCP_NOTSENT_LOWAT      25
+#endif
+
+#ifndef SO_INCOMING_CPU
+# define SO_INCOMING_CPU        49
+#endif
+
+#define SOCK_SPLICE_MAX (1 << 16)   /* default pipe capacity */
+
+const struct sock_profile sock_profile_latency = {
+    .nodelay       = true,
+    .quickack      = true,
+    .notsent_lowat = 16 * KB,
+    .busy_poll     = 50,
+    .incoming_cpu  = -1,
+    .reuseport     = true,
+};
+
+const struct sock_profile sock_profile_throughput = {
+    .nodelay       = false,
+    .notsent_lowat = 128 * KB,
+    .incoming_cpu  = -1,
+    .sndbuf        = 4 * MB,
+    .rcvbuf        = 4 * MB,
+    .defer_accept  = 1,
+    .reuseport     = true,
+};
+
+static struct sock_metrics *sock_metrics = NULL;
+
+void
+sock_metrics_setup(struct sock_metrics *m)
+{
+    sock_metrics = m;
+}
 
 int
 sock_set_blocking(int sd)
@@ -35,14 +111,45 @@ sock_set_reuseaddr(int sd)
     return setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &reuse, len);
 }
 
+int
+sock_set_reuseport(int sd)
+{
+    int reuse = 1;
+    socklen_t len = sizeof(reuse);
+
+    return setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &reuse, len);
+}
+
+/* spare descriptor, given up by _sock_accept_shed when out of descriptors */
+static int sock_reserve_fd = -1;
+
+static void
+_sock_reserve_open(void)
+{
+    int fd, none = -1;
+
+    if (__atomic_load_n(&sock_reserve_fd, __ATOMIC_ACQUIRE) >= 0) {
+        return;
+    }
+
+    fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    if (!__atomic_compare_exchange_n(&sock_reserve_fd, &none, fd, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(fd);
+    }
+}
+
 int
 sock_set_tcpnodelay(int sd)
 {
-//    int nodelay = 1;
-//    socklen_t len = sizeof(nodelay);
-//
-//    return setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &nodelay, len);
-    return CMN_OK;
+    int nodelay = 1;
+    socklen_t len = sizeof(nodelay);
+
+    return setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &nodelay, len);
 }
 
 int
@@ -54,6 +161,137 @@ sock_set_linger(int sd, int timeout)
     return setsockopt(sd, SOL_SOCKET, SO_LINGER, &linger, len);
 }
 
+/* spin up to usec in the driver on blocking reads, needs CAP_NET_ADMIN to raise */
+int
+sock_set_busy_poll(int sd, int usec)
+{
+#ifdef SO_BUSY_POLL
+    socklen_t len = sizeof(usec);
+
+    return setsockopt(sd, SOL_SOCKET, SO_BUSY_POLL, &usec, len);
+#else
+    errno = ENOPROTOOPT;
+
+    return CMN_ERROR;
+#endif
+}
+
+static int
+_sock_setopt(int sd, int level, int name, int val, const char *what)
+{
+    if (setsockopt(sd, level, name, &val, sizeof(val)) < 0) {
+        log_warn("set %s to %d on sd %d failed: %s", what, val, sd, strerror(errno));
+        return CMN_ERROR;
+    }
+
+    return CMN_OK;
+}
+
+/* options every socket of a profile has, listeners pass them on */
+static int
+_sock_profile_conn(int sd, const struct sock_profile *p)
+{
+    int status = CMN_OK;
+
+    if (p->nodelay) {
+        status |= _sock_setopt(sd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (p->notsent_lowat > 0) {
+        status |= _sock_setopt(sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p->notsent_lowat,
+                               "TCP_NOTSENT_LOWAT");
+    }
+    if (p->busy_poll > 0) {
+        status |= _sock_setopt(sd, SOL_SOCKET, SO_BUSY_POLL, p->busy_poll, "SO_BUSY_POLL");
+    }
+    if (p->incoming_cpu >= 0) {
+        status |= _sock_setopt(sd, SOL_SOCKET, SO_INCOMING_CPU, p->incoming_cpu,
+                               "SO_INCOMING_CPU");
+    }
+    if (p->sndbuf > 0) {
+        status |= _sock_setopt(sd, SOL_SOCKET, SO_SNDBUF, p->sndbuf, "SO_SNDBUF");
+    }
+    if (p->rcvbuf > 0) {
+        status |= _sock_setopt(sd, SOL_SOCKET, SO_RCVBUF, p->rcvbuf, "SO_RCVBUF");
+    }
+
+    return status != CMN_OK ? CMN_ERROR : CMN_OK;
+}
+
+int
+sock_profile_listen(int sd, const struct sock_profile *p)
+{
+    int status;
+
+    status = _sock_profile_conn(sd, p);
+
+    if (p->reuseport) {
+        status |= _sock_setopt(sd, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+    }
+    if (p->fastopen > 0) {
+        status |= _sock_setopt(sd, IPPROTO_TCP, TCP_FASTOPEN, p->fastopen, "TCP_FASTOPEN");
+    }
+    if (p->defer_accept > 0) {
+        status |= _sock_setopt(sd, IPPROTO_TCP, TCP_DEFER_ACCEPT, p->defer_accept,
+                               "TCP_DEFER_ACCEPT");
+    }
+
+    return status != CMN_OK ? CMN_ERROR : CMN_OK;
+}
+
+int
+sock_profile_accepted(int sd, const struct sock_profile *p)
+{
+    if (p->quickack) {
+        return _sock_setopt(sd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    }
+
+    return CMN_OK;
+}
+
+int
+sock_profile_connect(int sd, const struct sock_profile *p)
+{
+    int status;
+
+    status = _sock_profile_conn(sd, p);
+
+    if (p->quickack) {
+        status |= _sock_setopt(sd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    }
+    if (p->fastopen > 0) {
+        status |= _sock_setopt(sd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1,
+                               "TCP_FASTOPEN_CONNECT");
+    }
+
+    return status != CMN_OK ? CMN_ERROR : CMN_OK;
+}
+
+int
+sock_set_zerocopy(int sd)
+{
+    int zc = 1;
+    socklen_t len = sizeof(zc);
+
+    return setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &zc, len);
+}
+
+int
+sock_set_udp_segment(int sd, int size)
+{
+    socklen_t len = sizeof(size);
+
+    return setsockopt(sd, SOL_UDP, UDP_SEGMENT, &size, len);
+}
+
+int
+sock_set_udp_gro(int sd, bool is_on)
+{
+    int gro = is_on ? 1 : 0;
+    socklen_t len = sizeof(gro);
+
+    return setsockopt(sd, SOL_UDP, UDP_GRO, &gro, len);
+}
+
 int
 sock_set_sndbuf(int sd, int size)
 {
@@ -193,196 +431,1454 @@ sock_send(struct sock_conn *c, void *buf, size_t nbyte)
     return CMN_ERROR;
 }
 
-struct sock_conn *
-sock_conn_create(bool is_listen, void *data)
+int
+sock_recvv(struct sock_conn *c, struct iovec *iov, int iovcnt)
 {
-    struct sock_conn *c = (struct sock_conn *)cmn_alloc(sizeof(struct sock_conn));
+    ssize_t n;
 
-    if (c == NULL) {
-        log_error("connection creation failed, %s", strerror(errno));
-        return NULL;
+    ASSERT(iov != NULL);
+    ASSERT(iovcnt > 0);
+
+    for (;;) {
+        n = readv(c->sd, iov, MIN(iovcnt, SOCK_IOV_MAX));
+        if (n > 0) {
+            c->recv_nbyte += (size_t)n;
+            return n;
+        }
+
+        if (n == 0) {
+            log_debug("eof recv'd on sd %d, total: rb %zu sb %zu", c->sd,
+                      c->recv_nbyte, c->send_nbyte);
+            return n;
+        }
+
+        if (errno == EINTR) {
+            log_debug("recv on sd %d not ready - EINTR", c->sd);
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            log_debug("recv on sd %d not ready - EAGAIN", c->sd);
+            return CMN_EAGAIN;
+        } else {
+            c->err = errno;
+            log_error("recv on sd %d failed: %s", c->sd, strerror(errno));
+            return CMN_ERROR;
+        }
     }
-    memset(c, 0x00, sizeof(struct sock_conn));
-    c->is_listen = is_listen;
-    c->data = data;
 
-    return c;
+    return CMN_ERROR;
 }
 
-void
-sock_conn_destroy(struct sock_conn **conn)
+/* consume n sent bytes from the front of iov, returns the first unsent buffer */
+static int
+_sock_iov_advance(struct iovec *iov, int iovcnt, size_t n)
 {
-    struct sock_conn *c = *conn;
+    int i;
 
-    if (c != NULL) {
-        cmn_free(c);
-        *conn = NULL;
+    for (i = 0; i < iovcnt && n > 0; i++) {
+        if (n < iov[i].iov_len) {
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+            break;
+        }
+
+        n -= iov[i].iov_len;
+        iov[i].iov_len = 0;
+    }
+
+    while (i < iovcnt && iov[i].iov_len == 0) {
+        i++;
+    }
+
+    return i;
+}
+
+/*
+ * # buffers of iov to write so that at most limit bytes go out, the last one
+ * is shortened in place by *cut bytes, which the caller gives back
+ */
+static int
+_sock_iov_limit(struct iovec *iov, int iovcnt, size_t limit, size_t *cut)
+{
+    size_t nbyte = 0;
+    int i;
+
+    *cut = 0;
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > limit - nbyte) {
+            *cut = iov[i].iov_len - (limit - nbyte);
+            iov[i].iov_len = limit - nbyte;
+            return i + 1;
+        }
+        nbyte += iov[i].iov_len;
     }
+
+    return iovcnt;
 }
 
 int
-sock_resolve(char *name, int port, struct addrinfo *si, bool is_ipv4)
+sock_sendv(struct sock_conn *c, struct iovec *iov, int iovcnt)
 {
-    int status;
-    struct addrinfo *ai, *cai;
-    struct addrinfo hints;
-    char *node = NULL;
-    char service[NI_MAXSERV];
-    bool found;
+    ssize_t n;
+    size_t total = 0, cut;
+    int i, cnt;
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_flags = AI_NUMERICSERV;
-    hints.ai_family = AF_UNSPEC;     /* AF_INET or AF_INET6 */
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = 0;
-    hints.ai_addrlen = 0;
-    hints.ai_addr = NULL;
-    hints.ai_canonname = NULL;
+    ASSERT(iov != NULL);
 
-    if (name != NULL) {
-        node = (char *)name;
-    }
+    /* the byte count is returned as an int */
+    i = _sock_iov_advance(iov, iovcnt, 0);
+    while (i < iovcnt && total < (size_t)INT_MAX) {
+        cnt = _sock_iov_limit(iov + i, MIN(iovcnt - i, SOCK_IOV_MAX),
+                              (size_t)INT_MAX - total, &cut);
+        n = writev(c->sd, iov + i, cnt);
+        iov[i + cnt - 1].iov_len += cut;
 
-    cmn_snprintf(service, NI_MAXSERV, "%d", port);
+        if (n > 0) {
+            c->send_nbyte += (size_t)n;
+            total += (size_t)n;
+            i += _sock_iov_advance(iov + i, iovcnt - i, (size_t)n);
+            continue;
+        }
 
-    status = getaddrinfo(node, service, &hints, &ai);
-    if (status != 0) {
-        log_error("address resolution of node '%s' service '%s' failed: %s",
-                  node, service, gai_strerror(status));
-        return CMN_ERROR;
-    }
+        if (n == 0) {
+            log_warn("writev on sd %d returned zero", c->sd);
+            break;
+        }
 
-    for (cai = ai, found = false; cai != NULL; cai = cai->ai_next) {
-        cmn_memcpy(si, cai, sizeof(struct addrinfo));
-        if (is_ipv4) {
-            if (cai->ai_family == AF_INET) {
-                found = true;
-                break;
-            }
+        if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            log_debug("writev on sd %d not ready - EAGAIN", c->sd);
+            return total > 0 ? (int)total : CMN_EAGAIN;
         } else {
-            found = true;
-            break;
+            c->err = errno;
+            log_error("writev on sd %d failed: %s", c->sd, strerror(errno));
+            return total > 0 ? (int)total : CMN_ERROR;
         }
     }
-    freeaddrinfo(ai);
 
-    return !found ? CMN_ERROR : CMN_OK;
+    return (int)total;
 }
 
 int
-nc_unresolve(struct addrinfo *si, char *buf, int buf_size)
+sock_sendfile(struct sock_conn *c, int fd, off_t *offset, size_t nbyte)
 {
-    char host[NI_MAXHOST], service[NI_MAXSERV];
-    int status;
+    ssize_t n;
+    size_t total = 0;
 
+    ASSERT(offset != NULL);
 
-    status = getnameinfo(si->ai_addr, si->ai_addrlen, host, sizeof(host),
-                         service, sizeof(service),
-                         NI_NUMERICHOST | NI_NUMERICSERV);
-    if (status < 0) {
-        log_error("getnameinfo error, %d:%s", status, gai_strerror(status));
-        return CMN_ERROR;
+    /* the byte count is returned as an int */
+    nbyte = MIN(nbyte, (size_t)INT_MAX);
+
+    while (total < nbyte) {
+        n = sendfile(c->sd, fd, offset, nbyte - total);
+
+        if (n > 0) {
+            c->send_nbyte += (size_t)n;
+            total += (size_t)n;
+            continue;
+        }
+
+        if (n == 0) {
+            /* end of file */
+            break;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            log_debug("sendfile on sd %d not ready - EAGAIN", c->sd);
+            return total > 0 ? (int)total : CMN_EAGAIN;
+        } else {
+            c->err = errno;
+            log_error("sendfile of fd %d on sd %d failed: %s", fd, c->sd, strerror(errno));
+            return total > 0 ? (int)total : CMN_ERROR;
+        }
     }
 
-    cmn_snprintf(buf, buf_size, "%s:%s", host, service);
-    return CMN_OK;
+    return (int)total;
 }
 
-bool
-sock_connect(struct addrinfo *ai, struct sock_conn *c)
+int
+sock_relay_init(struct sock_relay *r)
 {
-    int ret;
+    if (pipe2(r->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log_error("relay pipe creation failed: %s", strerror(errno));
+        return CMN_ERROR;
+    }
+    r->npipe = 0;
 
-    ASSERT(c != NULL);
+    return CMN_OK;
+}
 
-    c->sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-    if (c->sd < 0) {
-        log_error("socket create for sock_conn %p failed: %s", c, strerror(errno));
-        goto error;
+void
+sock_relay_deinit(struct sock_relay *r)
+{
+    if (r->npipe > 0) {
+        log_warn("relay pipe closed with %zu bytes pending", r->npipe);
     }
 
-    ret = sock_set_tcpnodelay(c->sd);
+    close(r->pipe[0]);
+    close(r->pipe[1]);
+    r->pipe[0] = r->pipe[1] = -1;
+    r->npipe = 0;
+}
+
+int
+sock_splice(struct sock_relay *r, struct sock_conn *src, struct sock_conn *dst,
+            size_t nbyte)
+{
+    ssize_t n;
+    size_t total = 0;
+    bool is_eof = false;
+
+    /* the byte count is returned as an int */
+    nbyte = MIN(nbyte, (size_t)INT_MAX);
+
+    while (total < nbyte) {
+        /* fill the pipe, unless it still holds what dst did not take */
+        if (r->npipe == 0 && !is_eof) {
+            n = splice(src->sd, NULL, r->pipe[1], NULL,
+                       MIN(nbyte - total, SOCK_SPLICE_MAX),
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                src->recv_nbyte += (size_t)n;
+                r->npipe += (size_t)n;
+            } else if (n == 0) {
+                is_eof = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else {
+                src->err = errno;
+                log_error("splice from sd %d failed: %s", src->sd, strerror(errno));
+                return total > 0 ? (int)total : CMN_ERROR;
+            }
+        }
+
+        if (r->npipe == 0) {
+            break;
+        }
+
+        n = splice(r->pipe[0], NULL, dst->sd, NULL, r->npipe,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            dst->send_nbyte += (size_t)n;
+            r->npipe -= (size_t)n;
+            total += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            dst->err = n < 0 ? errno : EPIPE;
+            log_error("splice to sd %d failed: %s", dst->sd, strerror(dst->err));
+            return total > 0 ? (int)total : CMN_ERROR;
+        }
+    }
+
+    if (total == 0 && !(is_eof && r->npipe == 0)) {
+        return CMN_EAGAIN;
+    }
+
+    return (int)total;
+}
+
+int
+sock_send_zc(struct sock_conn *c, void *buf, size_t nbyte)
+{
+    ssize_t n;
+
+    ASSERT(buf != NULL);
+    ASSERT(nbyte > 0);
+
+    for (;;) {
+        n = send(c->sd, buf, nbyte, MSG_ZEROCOPY | MSG_DONTWAIT);
+
+        if (n >= 0) {
+            /* the kernel numbers every send that did not fail */
+            c->zc_next++;
+            c->send_nbyte += (size_t)n;
+            return n;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            log_debug("zerocopy send on sd %d not ready - EAGAIN", c->sd);
+            return CMN_EAGAIN;
+        } else {
+            c->err = errno;
+            log_error("zerocopy send on sd %d failed: %s", c->sd, strerror(errno));
+            return CMN_ERROR;
+        }
+    }
+
+    return CMN_ERROR;
+}
+
+int
+sock_zc_reap(struct sock_conn *c)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *ee;
+    char ctl[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    int ndone = 0;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = ctl;
+        msg.msg_controllen = sizeof(ctl);
+
+        if (recvmsg(c->sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return ndone;
+            }
+            c->err = errno;
+            log_error("recv error queue of sd %d failed: %s", c->sd, strerror(errno));
+            return ndone > 0 ? ndone : CMN_ERROR;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            /* sends ee_info..ee_data (inclusive) completed */
+            ndone += (int)(ee->ee_data - ee->ee_info + 1);
+            if ((int32_t)(ee->ee_data + 1 - c->zc_done) > 0) {
+                c->zc_done = ee->ee_data + 1;
+            }
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                c->zc_copied++;
+            }
+        }
+    }
+}
+
+int
+sock_queue(struct sock_conn *c, void *buf, size_t nbyte)
+{
+    struct iovec *oq;
+    int size;
+
+    ASSERT(buf != NULL);
+
+    if (nbyte == 0) {
+        return CMN_OK;
+    }
+
+    if (c->noq == c->oq_size) {
+        size = c->oq_size == 0 ? 16 : c->oq_size * 2;
+        oq = (struct iovec *)cmn_realloc(c->oq, (size_t)size * sizeof(*oq));
+        if (oq == NULL) {
+            log_error("output queue of sd %d grow to %d failed: %s", c->sd, size,
+                      strerror(errno));
+            return CMN_ERROR;
+        }
+        c->oq = oq;
+        c->oq_size = size;
+    }
+
+    c->oq[c->noq].iov_base = buf;
+    c->oq[c->noq].iov_len = nbyte;
+    c->noq++;
+    c->oq_nbyte += nbyte;
+
+    return CMN_OK;
+}
+
+int
+sock_flush(struct sock_conn *c)
+{
+    int n, i;
+
+    if (c->noq == 0) {
+        return CMN_OK;
+    }
+
+    n = sock_sendv(c, c->oq, c->noq);
+    if (n <= 0) {
+        return n;
+    }
+
+    c->oq_nbyte -= (size_t)n;
+
+    /* drop the sent buffers, the partly sent one is already advanced */
+    i = _sock_iov_advance(c->oq, c->noq, 0);
+    if (i == c->noq) {
+        c->noq = 0;
+    } else if (i > 0) {
+        memmove(c->oq, c->oq + i, (size_t)(c->noq - i) * sizeof(*c->oq));
+        c->noq -= i;
+    }
+
+    return n;
+}
+
+struct sock_conn *
+sock_conn_create(bool is_listen, void *data)
+{
+    struct sock_conn *c = (struct sock_conn *)cmn_alloc(sizeof(struct sock_conn));
+
+    if (c == NULL) {
+        log_error("connection creation failed, %s", strerror(errno));
+        return NULL;
+    }
+    memset(c, 0x00, sizeof(struct sock_conn));
+    c->is_listen = is_listen;
+    c->data = data;
+
+    return c;
+}
+
+static void _sock_conn_pool_put(struct sock_conn_pool *pool, struct sock_conn *c);
+
+void
+sock_conn_destroy(struct sock_conn **conn)
+{
+    struct sock_conn *c = *conn;
+
+    if (c == NULL) {
+        return;
+    }
+
+    if (c->pool != NULL) {
+        _sock_conn_pool_put(c->pool, c);
+        *conn = NULL;
+        return;
+    }
+
+    if (c->oq != NULL) {
+        cmn_free(c->oq);
+    }
+    cmn_free(c);
+    *conn = NULL;
+}
+
+#define SOCK_CONN_SLAB_BYTES   (256 * KB)   /* target size of a slab */
+
+static void
+_sock_conn_pool_free(struct sock_conn_pool *pool)
+{
+    struct sock_conn *c;
+    uint32_t i;
+
+    for (c = pool->free; c != NULL; c = c->free_next) {
+        if (c->oq != NULL) {
+            cmn_free(c->oq);
+        }
+    }
+
+    for (i = 0; i < pool->nslab; i++) {
+        cmn_free(pool->slabs[i]);
+    }
+    if (pool->slabs != NULL) {
+        cmn_free(pool->slabs);
+    }
+    cmn_free(pool);
+}
+
+static int
+_sock_conn_pool_grow(struct sock_conn_pool *pool)
+{
+    struct sock_conn *c;
+    struct rbuf *buf;
+    void **slabs;
+    char *slab;
+    uint32_t i, n;
+    size_t off;
+
+    n = pool->nslab_obj;
+    if (pool->max_obj > 0) {
+        n = MIN(n, pool->max_obj - (pool->nused + pool->nfree));
+        if (n == 0) {
+            return CMN_ERROR;
+        }
+    }
+
+    slabs = (void **)cmn_realloc(pool->slabs, (pool->nslab + 1) * sizeof(*slabs));
+    if (slabs == NULL) {
+        return CMN_EMEM;
+    }
+    pool->slabs = slabs;
+
+    if (posix_memalign((void **)&slab, CMN_CACHELINE_SIZE, n * pool->obj_size) != 0) {
+        log_error("sock_conn slab of %u objects failed: %s", n, strerror(ENOMEM));
+        return CMN_EMEM;
+    }
+    pool->slabs[pool->nslab++] = slab;
+
+    /* push in reverse, so the first objects of the slab go out first */
+    for (i = n; i > 0; i--) {
+        c = (struct sock_conn *)(slab + (i - 1) * pool->obj_size);
+        memset(c, 0, sizeof(*c));
+        c->pool = pool;
+
+        off = CMN_ALIGN(sizeof(*c), CMN_ALIGNMENT);
+        if (pool->rbuf_cap > 0) {
+            buf = (struct rbuf *)((char *)c + off);
+            buf->cap = pool->rbuf_cap;
+            c->rbuf = buf;
+            off += CMN_ALIGN(RBUF_HDR_SIZE + pool->rbuf_cap + 1, CMN_ALIGNMENT);
+        }
+        if (pool->wbuf_cap > 0) {
+            buf = (struct rbuf *)((char *)c + off);
+            buf->cap = pool->wbuf_cap;
+            c->wbuf = buf;
+        }
+
+        c->free_next = pool->free;
+        pool->free = c;
+        pool->nfree++;
+    }
+
+    return CMN_OK;
+}
+
+struct sock_conn_pool *
+sock_conn_pool_create(uint32_t nprealloc, uint32_t max_obj, uint32_t rbuf_cap,
+                      uint32_t wbuf_cap)
+{
+    struct sock_conn_pool *pool;
+    size_t size;
+
+    pool = (struct sock_conn_pool *)cmn_zalloc(sizeof(*pool));
+    if (pool == NULL) {
+        log_error("sock_conn pool creation failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    size = CMN_ALIGN(sizeof(struct sock_conn), CMN_ALIGNMENT);
+    if (rbuf_cap > 0) {
+        size += CMN_ALIGN(RBUF_HDR_SIZE + rbuf_cap + 1, CMN_ALIGNMENT);
+    }
+    if (wbuf_cap > 0) {
+        size += CMN_ALIGN(RBUF_HDR_SIZE + wbuf_cap + 1, CMN_ALIGNMENT);
+    }
+
+    pool->obj_size = CMN_ALIGN(size, CMN_CACHELINE_SIZE);
+    pool->nslab_obj = (uint32_t)MAX(SOCK_CONN_SLAB_BYTES / pool->obj_size, 1);
+    pool->max_obj = max_obj;
+    pool->rbuf_cap = rbuf_cap;
+    pool->wbuf_cap = wbuf_cap;
+
+    while (pool->nfree < nprealloc) {
+        if (_sock_conn_pool_grow(pool) != CMN_OK) {
+            _sock_conn_pool_free(pool);
+            return NULL;
+        }
+    }
+
+    log_info("sock_conn pool %p with %u objects of %zu bytes", pool, pool->nfree,
+             pool->obj_size);
+
+    return pool;
+}
+
+void
+sock_conn_pool_destroy(struct sock_conn_pool **pool)
+{
+    struct sock_conn_pool *p = *pool;
+
+    if (p == NULL) {
+        return;
+    }
+
+    *pool = NULL;
+
+    if (p->nused > 0) {
+        log_warn("sock_conn pool %p destroyed with %u objects in use", p, p->nused);
+        p->is_destroy = true;
+        return;
+    }
+
+    _sock_conn_pool_free(p);
+}
+
+struct sock_conn *
+sock_conn_pool_get(struct sock_conn_pool *pool, bool is_listen, void *data)
+{
+    struct sock_conn *c;
+
+    ASSERT(pool != NULL && !pool->is_destroy);
+
+    if (pool->free == NULL && _sock_conn_pool_grow(pool) != CMN_OK) {
+        log_error("sock_conn pool %p exhausted with %u objects in use", pool,
+                  pool->nused);
+        return NULL;
+    }
+
+    c = pool->free;
+    pool->free = c->free_next;
+    pool->nfree--;
+    pool->nused++;
+
+    /* the oq array and the embedded buffers are kept for the next user */
+    c->is_listen = is_listen;
+    c->sd = -1;
+    c->err = 0;
+    c->recv_nbyte = 0;
+    c->send_nbyte = 0;
+    c->data = data;
+    c->noq = 0;
+    c->oq_nbyte = 0;
+    c->zc_next = 0;
+    c->zc_done = 0;
+    c->zc_copied = 0;
+    c->connecting = NULL;
+    c->free_next = NULL;
+    if (c->rbuf != NULL) {
+        c->rbuf->rpos = c->rbuf->wpos = 0;
+    }
+    if (c->wbuf != NULL) {
+        c->wbuf->rpos = c->wbuf->wpos = 0;
+    }
+
+    return c;
+}
+
+static void
+_sock_conn_pool_put(struct sock_conn_pool *pool, struct sock_conn *c)
+{
+    ASSERT(pool->nused > 0);
+    ASSERT(c->connecting == NULL);
+
+    c->free_next = pool->free;
+    pool->free = c;
+    pool->nfree++;
+    pool->nused--;
+
+    if (pool->is_destroy && pool->nused == 0) {
+        _sock_conn_pool_free(pool);
+    }
+}
+
+int
+sock_resolve(const char *name, int port, struct sock_addr *sa, bool is_ipv4)
+{
+    int status;
+    struct addrinfo *ai, *cai;
+    struct addrinfo hints;
+    const char *node = NULL;
+    char service[NI_MAXSERV];
+    bool found;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_NUMERICSERV;
+    hints.ai_family = AF_UNSPEC;     /* AF_INET or AF_INET6 */
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = 0;
+    hints.ai_addrlen = 0;
+    hints.ai_addr = NULL;
+    hints.ai_canonname = NULL;
+
+    if (name != NULL) {
+        node = name;
+    } else {
+        hints.ai_flags |= AI_PASSIVE;
+    }
+
+    cmn_snprintf(service, NI_MAXSERV, "%d", port);
+
+    status = getaddrinfo(node, service, &hints, &ai);
+    if (status != 0) {
+        log_error("address resolution of node '%s' service '%s' failed: %s",
+                  node, service, gai_strerror(status));
+        return CMN_ERROR;
+    }
+
+    for (cai = ai, found = false; cai != NULL; cai = cai->ai_next) {
+        if (is_ipv4 && cai->ai_family != AF_INET) {
+            continue;
+        }
+        if (cai->ai_addrlen > sizeof(sa->addr)) {
+            continue;
+        }
+
+        /* copy the address, it is freed with the list */
+        sa->family = cai->ai_family;
+        sa->socktype = cai->ai_socktype;
+        sa->protocol = cai->ai_protocol;
+        sa->addrlen = cai->ai_addrlen;
+        memcpy(&sa->addr, cai->ai_addr, cai->ai_addrlen);
+        found = true;
+        break;
+    }
+    freeaddrinfo(ai);
+
+    return !found ? CMN_ERROR : CMN_OK;
+}
+
+int
+nc_unresolve(struct addrinfo *si, char *buf, int buf_size)
+{
+    char host[NI_MAXHOST], service[NI_MAXSERV];
+    int status;
+
+
+    status = getnameinfo(si->ai_addr, si->ai_addrlen, host, sizeof(host),
+                         service, sizeof(service),
+                         NI_NUMERICHOST | NI_NUMERICSERV);
+    if (status < 0) {
+        log_error("getnameinfo error, %d:%s", status, gai_strerror(status));
+        return CMN_ERROR;
+    }
+
+    cmn_snprintf(buf, buf_size, "%s:%s", host, service);
+    return CMN_OK;
+}
+
+bool
+sock_connect(struct addrinfo *ai, struct sock_conn *c)
+{
+    int ret;
+
+    ASSERT(c != NULL);
+
+    c->sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (c->sd < 0) {
+        log_error("socket create for sock_conn %p failed: %s", c, strerror(errno));
+        goto error;
+    }
+
+    /* not fatal, the address may not be tcp */
+    ret = sock_set_tcpnodelay(c->sd);
+    if (ret < 0) {
+        log_warn("set tcpnodelay on c %p sd %d failed, ignored: %s", c, c->sd,
+                 strerror(errno));
+    }
+
+    ret = connect(c->sd, ai->ai_addr, ai->ai_addrlen);
+    if (ret < 0) {
+        if (errno != EINPROGRESS) {
+            log_error("connect on c %p sd %d failed: %s", c, c->sd, strerror(errno));
+            goto error;
+        }
+        log_info("connecting on c %p sd %d (error)", c, c->sd);
+    } else {
+        log_info("connected on c %p sd %d (ok)", c, c->sd);
+    }
+
+
+    ret = sock_set_nonblocking(c->sd);
     if (ret < 0) {
-        log_error("set tcpnodelay on c %p sd %d failed: %s", c, c->sd, strerror(errno));
+        log_error("set nonblock on c %p sd %d failed: %s", c, c->sd, strerror(errno));
+        goto error;
+    }
+
+    return true;
+
+error:
+    c->err = errno;
+    if (c->sd > 0) {
+        close(c->sd);
+    }
+
+    return false;
+}
+
+struct sock_connecting {
+    struct event_base *evb;
+    struct sock_conn  *c;
+    struct timer      timer;    /* connect deadline */
+    sock_connect_fn   cb;
+    void              *arg;
+};
+
+static void _sock_connect_ready(void *arg, uint32_t events);
+
+static const struct event_handler sock_connect_handler = {
+    .read  = NULL,
+    .write = _sock_connect_ready,
+    .error = _sock_connect_ready,
+};
+
+static void
+_sock_connect_done(struct sock_connecting *sc, int err)
+{
+    struct sock_conn *c = sc->c;
+    sock_connect_fn cb = sc->cb;
+    void *arg = sc->arg;
+
+    event_timer_del(sc->evb, &sc->timer);
+    event_del(sc->evb, c->sd);
+
+    c->connecting = NULL;
+    cmn_free(sc);
+
+    if (err != 0) {
+        log_debug("connect on c %p sd %d failed: %s", c, c->sd, strerror(err));
+        c->err = err;
+        close(c->sd);
+        c->sd = -1;
+    }
+
+    cb(c, err, arg);
+}
+
+static void
+_sock_connect_ready(void *arg, uint32_t events)
+{
+    struct sock_connecting *sc = arg;
+
+    /* errno is SO_ERROR, or why it could not be read */
+    sock_get_soerror(sc->c->sd);
+
+    _sock_connect_done(sc, errno);
+}
+
+static void
+_sock_connect_timeout(void *arg)
+{
+    _sock_connect_done(arg, ETIMEDOUT);
+}
+
+int
+sock_connect_async(struct event_base *evb, struct addrinfo *ai, struct sock_conn *c,
+                   const struct sock_profile *p, int64_t timeout, sock_connect_fn cb,
+                   void *arg)
+{
+    struct sock_connecting *sc;
+    int ret;
+
+    ASSERT(evb != NULL && c != NULL && cb != NULL);
+    ASSERT(c->connecting == NULL);
+
+    c->sd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                   ai->ai_protocol);
+    if (c->sd < 0) {
+        log_error("socket create for sock_conn %p failed: %s", c, strerror(errno));
+        c->err = errno;
+        return CMN_ERROR;
+    }
+
+    if (p != NULL) {
+        /* tuning only, each failed option is logged by _sock_setopt */
+        ret = sock_profile_connect(c->sd, p);
+        if (ret != CMN_OK) {
+            log_warn("profile on c %p sd %d not fully applied, ignored", c, c->sd);
+        }
+    } else {
+        ret = sock_set_tcpnodelay(c->sd);
+        if (ret < 0) {
+            log_warn("set tcpnodelay on c %p sd %d failed, ignored: %s", c, c->sd,
+                     strerror(errno));
+        }
+    }
+
+    ret = connect(c->sd, ai->ai_addr, ai->ai_addrlen);
+    if (ret < 0 && errno != EINPROGRESS) {
+        log_error("connect on c %p sd %d failed: %s", c, c->sd, strerror(errno));
+        goto error;
+    }
+
+    sc = (struct sock_connecting *)cmn_alloc(sizeof(*sc));
+    if (sc == NULL) {
+        log_error("connect state for c %p failed: %s", c, strerror(errno));
+        goto error;
+    }
+
+    sc->evb = evb;
+    sc->c = c;
+    sc->cb = cb;
+    sc->arg = arg;
+    timer_init(&sc->timer, _sock_connect_timeout, sc);
+
+    /* writable means connected or failed, also when connect finished at once */
+    if (event_register(evb, c->sd, EVENT_WRITE, &sock_connect_handler, sc) < 0) {
+        cmn_free(sc);
+        goto error;
+    }
+
+    if (timeout >= 0) {
+        event_timer_add(evb, &sc->timer, timeout);
+    }
+
+    c->connecting = sc;
+
+    log_debug("connecting on c %p sd %d with timeout %lld", c, c->sd,
+              (long long)timeout);
+
+    return CMN_OK;
+
+error:
+    c->err = errno;
+    close(c->sd);
+    c->sd = -1;
+
+    return CMN_ERROR;
+}
+
+void
+sock_connect_cancel(struct sock_conn *c)
+{
+    struct sock_connecting *sc = c->connecting;
+
+    if (sc == NULL) {
+        return;
+    }
+
+    event_timer_del(sc->evb, &sc->timer);
+    event_del(sc->evb, c->sd);
+
+    c->connecting = NULL;
+    cmn_free(sc);
+
+    close(c->sd);
+    c->sd = -1;
+}
+
+static bool
+_sock_listen(struct addrinfo *ai, struct sock_conn *c, int max_backlog,
+             const struct sock_profile *p)
+{
+    struct sock_profile lp;
+    int ret;
+    int sd;
+
+    c->sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (c->sd < 0) {
+        log_error("socket failed: %s", strerror(errno));
+        goto error;
+    }
+
+    sd = c->sd;
+
+    ret = sock_set_reuseaddr(sd);
+    if (ret < 0) {
+        log_error("reuse of sd %d failed: %s", sd, strerror(errno));
+        goto error;
+    }
+
+    if (p != NULL && p->reuseport) {
+        ret = sock_set_reuseport(sd);
+        if (ret < 0) {
+            log_error("reuse port of sd %d failed: %s", sd, strerror(errno));
+            goto error;
+        }
+    }
+
+    if (p != NULL) {
+        /* the rest is tuning, a kernel without it still listens */
+        lp = *p;
+        lp.reuseport = false;
+        ret = sock_profile_listen(sd, &lp);
+        if (ret != CMN_OK) {
+            log_warn("profile on sd %d not fully applied, ignored", sd);
+        }
+    }
+
+    ret = bind(sd, ai->ai_addr, ai->ai_addrlen);
+    if (ret < 0) {
+        log_error("bind on sd %d failed: %s", sd, strerror(errno));
+        goto error;
+    }
+
+    /* accepted sockets inherit it, a profile has already decided */
+    if (p == NULL) {
+        ret = sock_set_tcpnodelay(sd);
+        if (ret < 0) {
+            log_warn("set tcp nodelay on sd %d failed, ignored: %s", sd, strerror(errno));
+        }
+        c->is_nodelay = ret == 0;
+    } else {
+        c->is_nodelay = p->nodelay;
+    }
+
+    _sock_reserve_open();
+
+    ret = listen(sd, max_backlog);
+    if (ret < 0) {
+        log_error("listen on sd %d failed: %s", sd, strerror(errno));
+        goto error;
+    }
+
+    ret = sock_set_nonblocking(sd);
+    if (ret != CMN_OK) {
+        log_error("set nonblock on sd %d failed: %s", sd, strerror(errno));
+        goto error;
+    }
+
+    log_info("server listen setup on socket descriptor %d", c->sd);
+    return true;
+
+error:
+    if (c->sd > 0) {
+        sock_close(c);
+    }
+
+    return false;
+}
+
+bool
+sock_listen(struct addrinfo *ai, struct sock_conn *c, int max_backlog)
+{
+    return _sock_listen(ai, c, max_backlog, NULL);
+}
+
+bool
+sock_listen_reuseport(struct addrinfo *ai, struct sock_conn *c, int max_backlog)
+{
+    static const struct sock_profile reuseport = {
+        .nodelay = true, .incoming_cpu = -1, .reuseport = true
+    };
+
+    return _sock_listen(ai, c, max_backlog, &reuseport);
+}
+
+bool
+sock_listen_profile(struct addrinfo *ai, struct sock_conn *c, int max_backlog,
+                    const struct sock_profile *p)
+{
+    return _sock_listen(ai, c, max_backlog, p);
+}
+
+static bool
+_sock_udp_open(struct addrinfo *ai, struct sock_conn *c)
+{
+    c->sd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (c->sd < 0) {
+        log_error("udp socket for sock_conn %p failed: %s", c, strerror(errno));
+        c->err = errno;
+        return false;
+    }
+
+    return true;
+}
+
+bool
+sock_udp_bind(struct addrinfo *ai, struct sock_conn *c, bool is_reuseport)
+{
+    int sd;
+
+    if (!_sock_udp_open(ai, c)) {
+        return false;
+    }
+
+    sd = c->sd;
+
+    if (sock_set_reuseaddr(sd) < 0) {
+        log_error("reuse of sd %d failed: %s", sd, strerror(errno));
+        goto error;
+    }
+
+    if (is_reuseport && sock_set_reuseport(sd) < 0) {
+        log_error("reuse port of sd %d failed: %s", sd, strerror(errno));
         goto error;
     }
 
-    ret = connect(c->sd, ai->ai_addr, ai->ai_addrlen);
-    if (ret < 0) {
-        if (errno != EINPROGRESS) {
-            log_error("connect on c %p sd %d failed: %s", c, c->sd, strerror(errno));
-            goto error;
+    if (bind(sd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        log_error("bind on udp sd %d failed: %s", sd, strerror(errno));
+        goto error;
+    }
+
+    log_info("udp bound on socket descriptor %d", sd);
+    return true;
+
+error:
+    c->err = errno;
+    sock_close(c);
+    return false;
+}
+
+bool
+sock_udp_connect(struct addrinfo *ai, struct sock_conn *c)
+{
+    if (!_sock_udp_open(ai, c)) {
+        return false;
+    }
+
+    if (connect(c->sd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        log_error("connect on udp sd %d failed: %s", c->sd, strerror(errno));
+        c->err = errno;
+        sock_close(c);
+        return false;
+    }
+
+    return true;
+}
+
+/* room for the UDP_GRO segment size of each message */
+#define SOCK_DGRAM_CMSG CMSG_SPACE(sizeof(int))
+
+int
+sock_recv_batch(struct sock_conn *c, struct sock_dgram *d, int n)
+{
+    struct mmsghdr msg[SOCK_MAX_BATCH];
+    struct iovec iov[SOCK_MAX_BATCH];
+    char ctl[SOCK_MAX_BATCH][SOCK_DGRAM_CMSG];
+    struct cmsghdr *cmsg;
+    int i, nrecv;
+
+    ASSERT(d != NULL);
+
+    n = MIN(n, SOCK_MAX_BATCH);
+    if (n <= 0) {
+        return CMN_OK;
+    }
+
+    memset(msg, 0, (size_t)n * sizeof(msg[0]));
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = d[i].buf;
+        iov[i].iov_len = d[i].size;
+        msg[i].msg_hdr.msg_iov = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+        msg[i].msg_hdr.msg_name = &d[i].addr;
+        msg[i].msg_hdr.msg_namelen = sizeof(d[i].addr);
+        msg[i].msg_hdr.msg_control = ctl[i];
+        msg[i].msg_hdr.msg_controllen = sizeof(ctl[i]);
+    }
+
+    for (;;) {
+        nrecv = recvmmsg(c->sd, msg, (unsigned)n, MSG_DONTWAIT, NULL);
+        if (nrecv >= 0) {
+            break;
         }
-        log_info("connecting on c %p sd %d (error)", c, c->sd);
+
+        if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            log_debug("recvmmsg on sd %d not ready - EAGAIN", c->sd);
+            return CMN_EAGAIN;
+        } else {
+            c->err = errno;
+            log_error("recvmmsg on sd %d failed: %s", c->sd, strerror(errno));
+            return CMN_ERROR;
+        }
+    }
+
+    for (i = 0; i < nrecv; i++) {
+        d[i].len = msg[i].msg_len;
+        d[i].addrlen = msg[i].msg_hdr.msg_namelen;
+        d[i].segsz = 0;
+        c->recv_nbyte += d[i].len;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg[i].msg_hdr); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int segsz;
+
+                memcpy(&segsz, CMSG_DATA(cmsg), sizeof(segsz));
+                d[i].segsz = (uint16_t)segsz;
+            }
+        }
+    }
+
+    return nrecv;
+}
+
+int
+sock_send_batch(struct sock_conn *c, struct sock_dgram *d, int n)
+{
+    struct mmsghdr msg[SOCK_MAX_BATCH];
+    struct iovec iov[SOCK_MAX_BATCH];
+    int i, nbatch, nsent, total = 0;
+
+    ASSERT(d != NULL);
+
+    while (total < n) {
+        nbatch = MIN(n - total, SOCK_MAX_BATCH);
+
+        memset(msg, 0, (size_t)nbatch * sizeof(msg[0]));
+        for (i = 0; i < nbatch; i++) {
+            iov[i].iov_base = d[total + i].buf;
+            iov[i].iov_len = d[total + i].len;
+            msg[i].msg_hdr.msg_iov = &iov[i];
+            msg[i].msg_hdr.msg_iovlen = 1;
+            if (d[total + i].addrlen > 0) {
+                msg[i].msg_hdr.msg_name = &d[total + i].addr;
+                msg[i].msg_hdr.msg_namelen = d[total + i].addrlen;
+            }
+        }
+
+        nsent = sendmmsg(c->sd, msg, (unsigned)nbatch, MSG_DONTWAIT);
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                log_debug("sendmmsg on sd %d not ready - EAGAIN", c->sd);
+                return total > 0 ? total : CMN_EAGAIN;
+            } else {
+                c->err = errno;
+                log_error("sendmmsg on sd %d failed: %s", c->sd, strerror(errno));
+                return total > 0 ? total : CMN_ERROR;
+            }
+        }
+
+        for (i = 0; i < nsent; i++) {
+            c->send_nbyte += msg[i].msg_len;
+        }
+        total += nsent;
+
+        if (nsent < nbatch) {
+            /* socket buffer is full */
+            break;
+        }
+    }
+
+    return total;
+}
+
+static int
+_sock_unix_addr(const char *path, struct sockaddr_un *sun, socklen_t *len)
+{
+    size_t n = strlen(path);
+
+    if (n == 0 || n >= sizeof(sun->sun_path)) {
+        log_error("unix socket path '%s' of %zu chars invalid", path, n);
+        errno = ENAMETOOLONG;
+        return CMN_ERROR;
+    }
+
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    memcpy(sun->sun_path, path, n);
+
+    if (path[0] == '@') {
+        /* abstract: leading nul, the name is not nul terminated */
+        sun->sun_path[0] = '\0';
+        *len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + n);
     } else {
-        log_info("connected on c %p sd %d (ok)", c, c->sd);
+        *len = (socklen_t)sizeof(*sun);
     }
 
+    return CMN_OK;
+}
 
-    ret = sock_set_nonblocking(c->sd);
+/* true if no one listens on sun any more, a live server sees a closed connection */
+static bool
+_sock_unix_stale(const struct sockaddr_un *sun, socklen_t len, int type)
+{
+    int sd, ret;
+
+    sd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd < 0) {
+        return false;
+    }
+
+    ret = connect(sd, (const struct sockaddr *)sun, len);
     if (ret < 0) {
-        log_error("set nonblock on c %p sd %d failed: %s", c, c->sd, strerror(errno));
+        ret = errno;
+    }
+    close(sd);
+
+    return ret == ECONNREFUSED || ret == ENOENT;
+}
+
+bool
+sock_unix_listen(const char *path, int type, struct sock_conn *c, int max_backlog)
+{
+    struct sockaddr_un sun;
+    socklen_t len;
+    struct stat st;
+
+    ASSERT(type == SOCK_STREAM || type == SOCK_SEQPACKET);
+
+    if (_sock_unix_addr(path, &sun, &len) != CMN_OK) {
+        c->err = errno;
+        return false;
+    }
+
+    c->sd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->sd < 0) {
+        log_error("unix socket for '%s' failed: %s", path, strerror(errno));
+        c->err = errno;
+        return false;
+    }
+
+    /* only a socket file is taken for stale, never a regular file */
+    if (path[0] != '@' && stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (!_sock_unix_stale(&sun, len, type)) {
+            log_error("unix socket '%s' is served by another process", path);
+            errno = EADDRINUSE;
+            goto error;
+        }
+        unlink(path);
+    }
+
+    if (bind(c->sd, (struct sockaddr *)&sun, len) < 0) {
+        log_error("bind on unix socket '%s' failed: %s", path, strerror(errno));
+        goto error;
+    }
+
+    if (listen(c->sd, max_backlog) < 0) {
+        log_error("listen on unix socket '%s' failed: %s", path, strerror(errno));
         goto error;
     }
 
+    c->is_listen = true;
+
+    log_info("unix listen setup on '%s' socket descriptor %d", path, c->sd);
     return true;
 
 error:
     c->err = errno;
-    if (c->sd > 0) {
-        close(c->sd);
-    }
-
+    sock_close(c);
+    c->sd = -1;
     return false;
 }
 
 bool
-sock_listen(struct addrinfo *ai, struct sock_conn *c, int max_backlog)
+sock_unix_connect(const char *path, int type, struct sock_conn *c)
 {
-    int ret;
-    int sd;
+    struct sockaddr_un sun;
+    socklen_t len;
 
-    c->sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    ASSERT(type == SOCK_STREAM || type == SOCK_SEQPACKET);
+
+    if (_sock_unix_addr(path, &sun, &len) != CMN_OK) {
+        c->err = errno;
+        return false;
+    }
+
+    c->sd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (c->sd < 0) {
-        log_error("socket failed: %s", strerror(errno));
-        goto error;
+        log_error("unix socket for '%s' failed: %s", path, strerror(errno));
+        c->err = errno;
+        return false;
     }
 
-    sd = c->sd;
+    /* a unix connect completes at once or fails, EAGAIN if the backlog is full */
+    if (connect(c->sd, (struct sockaddr *)&sun, len) < 0) {
+        log_error("connect to unix socket '%s' failed: %s", path, strerror(errno));
+        c->err = errno;
+        close(c->sd);
+        c->sd = -1;
+        return false;
+    }
 
-    ret = sock_set_reuseaddr(sd);
-    if (ret < 0) {
-        log_error("reuse of sd %d failed: %s", sd, strerror(errno));
-        goto error;
+    return true;
+}
+
+int
+sock_send_fds(struct sock_conn *c, void *buf, size_t nbyte, const int *fd, int nfd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char ctl[CMSG_SPACE(sizeof(int) * SOCK_MAX_FDS)];
+    ssize_t n;
+
+    ASSERT(buf != NULL && nbyte > 0);
+
+    if (nfd < 0 || nfd > SOCK_MAX_FDS) {
+        log_error("send of %d fds on sd %d failed: at most %d", nfd, c->sd, SOCK_MAX_FDS);
+        return CMN_ERROR;
     }
 
-    ret = bind(sd, ai->ai_addr, ai->ai_addrlen);
-    if (ret < 0) {
-        log_error("bind on sd %d failed: %s", sd, strerror(errno));
-        goto error;
+    iov.iov_base = buf;
+    iov.iov_len = nbyte;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfd > 0) {
+        memset(ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)nfd);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)nfd);
+        memcpy(CMSG_DATA(cmsg), fd, sizeof(int) * (size_t)nfd);
     }
 
-    ret = listen(sd, max_backlog);
-    if (ret < 0) {
-        log_error("listen on sd %d failed: %s", sd, strerror(errno));
-        goto error;
+    for (;;) {
+        n = sendmsg(c->sd, &msg, MSG_NOSIGNAL);
+        if (n > 0) {
+            c->send_nbyte += (size_t)n;
+            return n;
+        }
+
+        if (n == 0) {
+            log_warn("sendmsg on sd %d returned zero", c->sd);
+            return CMN_OK;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            log_debug("sendmsg on sd %d not ready - EAGAIN", c->sd);
+            return CMN_EAGAIN;
+        } else {
+            c->err = errno;
+            log_error("sendmsg of %d fds on sd %d failed: %s", nfd, c->sd, strerror(errno));
+            return CMN_ERROR;
+        }
     }
 
-    ret = sock_set_nonblocking(sd);
-    if (ret != CMN_OK) {
-        log_error("set nonblock on sd %d failed: %s", sd, strerror(errno));
-        goto error;
+    return CMN_ERROR;
+}
+
+int
+sock_recv_fds(struct sock_conn *c, void *buf, size_t nbyte, int *fd, int *nfd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char ctl[CMSG_SPACE(sizeof(int) * SOCK_MAX_FDS)];
+    ssize_t n;
+    int max, got;
+
+    ASSERT(buf != NULL && nbyte > 0);
+
+    max = MIN(MAX(*nfd, 0), SOCK_MAX_FDS);
+    *nfd = 0;
+
+    iov.iov_base = buf;
+    iov.iov_len = nbyte;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)max);
+
+    for (;;) {
+        n = recvmsg(c->sd, &msg, MSG_CMSG_CLOEXEC);
+        if (n >= 0) {
+            break;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            log_debug("recvmsg on sd %d not ready - EAGAIN", c->sd);
+            return CMN_EAGAIN;
+        } else {
+            c->err = errno;
+            log_error("recvmsg on sd %d failed: %s", c->sd, strerror(errno));
+            return CMN_ERROR;
+        }
     }
 
-    log_info("server listen setup on socket descriptor %d", c->sd);
-    return true;
+    c->recv_nbyte += (size_t)n;
 
-error:
-    if (c->sd > 0) {
-        sock_close(c);
+    if (msg.msg_flags & MSG_CTRUNC) {
+        log_warn("fds received on sd %d truncated to %d", c->sd, max);
     }
 
-    return false;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        got = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        got = MIN(got, max - *nfd);
+        memcpy(fd + *nfd, CMSG_DATA(cmsg), sizeof(int) * (size_t)got);
+        *nfd += got;
+    }
+
+    return n;
 }
 
 void
@@ -426,6 +1922,7 @@ _sock_accept(struct sock_conn *sc)
                 continue;
             }
 
+            INCR(sock_metrics, sock_accept_ex);
             log_error("accept on sd %d failed: %s", sc->sd, strerror(errno));
             return -1;
         }
@@ -436,10 +1933,83 @@ _sock_accept(struct sock_conn *sc)
     return sd;
 }
 
+/*
+ * out of descriptors, a pending connection keeps a level triggered listener
+ * readable forever: give up the reserve to accept and close it, then take
+ * the reserve back
+ */
+static void
+_sock_accept_shed(struct sock_conn *sc)
+{
+    int fd;
+
+    fd = __atomic_exchange_n(&sock_reserve_fd, -1, __ATOMIC_ACQ_REL);
+    if (fd < 0) {
+        return;
+    }
+
+    close(fd);
+
+    fd = accept4(sc->sd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd >= 0) {
+        close(fd);
+        log_warn("out of descriptors, connection on sd %d shed", sc->sd);
+    }
+
+    _sock_reserve_open();
+}
+
+int
+sock_accept_batch(struct sock_conn *sc, int *sd, int n)
+{
+    int i, fd;
+
+    ASSERT(sc->sd >= 0);
+
+    for (i = 0; i < n; ) {
+        fd = accept4(sc->sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0) {
+            sd[i++] = fd;
+            continue;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            /* ECONNABORTED and friends only lose this one connection */
+            INCR(sock_metrics, sock_accept_ex);
+            log_warn("accept on sd %d failed: %s", sc->sd, strerror(errno));
+            if (errno == ECONNABORTED || errno == EPROTO) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                _sock_accept_shed(sc);
+            }
+        }
+
+        break;
+    }
+
+    if (sock_metrics != NULL && i > 0) {
+        INCR(sock_metrics, sock_accept_batch);
+        INCR_N(sock_metrics, sock_accept, i);
+        UPDATE_VAL(sock_metrics, sock_accept_last, i);
+        if (i == n) {
+            INCR(sock_metrics, sock_accept_full);
+        }
+    }
+
+    return i;
+}
+
 bool
 sock_accept(struct sock_conn *sc, struct sock_conn *c)
 {
+#ifndef CMN_ACCEPT4
     int ret = 0;
+#endif
     int sd = -1;
 
     sd = _sock_accept(sc);
@@ -456,12 +2026,11 @@ sock_accept(struct sock_conn *sc, struct sock_conn *c)
     }
 #endif
 
-    ret = sock_set_tcpnodelay(sd);
-    if (ret < 0) {
-        log_warn("set tcp nodelay on sd %d failed, ignored: %s", sd, strerror(errno));
-    }
+    /* inherited from the listener, which follows its profile */
+    c->is_nodelay = sc->is_nodelay;
 
-    log_info("accepted c %d on sd %d", c->sd, sc->sd);
+    INCR(sock_metrics, sock_accept);
+    log_debug("accepted c %d on sd %d", c->sd, sc->sd);
 
     return true;
 }
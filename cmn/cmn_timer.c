@@ -0,0 +1,241 @@
+#include "cmn_base.h"
+#include "cmn_log.h"
+#include "cmn_timer.h"
+
+static inline int64_t
+_timer_now(void)
+{
+    return cmn_usec_mono() / 1000;
+}
+
+static void
+_timer_link(struct timer_wheel *tw, struct timer *t)
+{
+    struct timer_list *slot;
+    int64_t idx;
+    int i, shift;
+
+    idx = t->expire - tw->now;
+
+    if (idx < 0) {
+        /* already expired, fire on the next tick */
+        slot = &tw->root[tw->now & TW_ROOT_MASK];
+    } else if (idx < TW_ROOT_SIZE) {
+        slot = &tw->root[t->expire & TW_ROOT_MASK];
+    } else {
+        if (idx > TW_MAX_TIMEOUT) {
+            t->expire = tw->now + TW_MAX_TIMEOUT;
+            idx = TW_MAX_TIMEOUT;
+        }
+
+        for (i = 0, shift = TW_ROOT_BITS; i < TW_NLEVEL - 1; i++, shift += TW_LEVEL_BITS) {
+            if (idx < (1LL << (shift + TW_LEVEL_BITS))) {
+                break;
+            }
+        }
+        slot = &tw->level[i][(t->expire >> shift) & TW_LEVEL_MASK];
+    }
+
+    TAILQ_INSERT_TAIL(slot, t, link);
+    t->slot = slot;
+}
+
+/*
+ * move the timers of one upper slot down, returns the slot index so the
+ * caller knows whether the next level has to be cascaded as well
+ */
+static int
+_timer_cascade(struct timer_wheel *tw, int level, int index)
+{
+    struct timer_list list;
+    struct timer *t;
+
+    TAILQ_INIT(&list);
+    TAILQ_CONCAT(&list, &tw->level[level][index], link);
+
+    while ((t = TAILQ_FIRST(&list)) != NULL) {
+        TAILQ_REMOVE(&list, t, link);
+        _timer_link(tw, t);
+    }
+
+    return index;
+}
+
+struct timer_wheel *
+timer_wheel_create(void)
+{
+    struct timer_wheel *tw;
+    int i, j;
+
+    tw = (struct timer_wheel *)cmn_alloc(sizeof(*tw));
+    if (tw == NULL) {
+        log_error("timer wheel creation failed, %s", strerror(errno));
+        return NULL;
+    }
+
+    tw->now = _timer_now();
+    tw->ntimer = 0;
+
+    for (i = 0; i < TW_ROOT_SIZE; i++) {
+        TAILQ_INIT(&tw->root[i]);
+    }
+
+    for (i = 0; i < TW_NLEVEL; i++) {
+        for (j = 0; j < TW_LEVEL_SIZE; j++) {
+            TAILQ_INIT(&tw->level[i][j]);
+        }
+    }
+
+    return tw;
+}
+
+void
+timer_wheel_destroy(struct timer_wheel **tw)
+{
+    struct timer_wheel *w = *tw;
+
+    if (w == NULL) {
+        return;
+    }
+
+    if (w->ntimer > 0) {
+        log_warn("destroy timer wheel %p with %u pending timers", w, w->ntimer);
+    }
+
+    cmn_free(w);
+    *tw = NULL;
+}
+
+void
+timer_wheel_add(struct timer_wheel *tw, struct timer *t, int64_t timeout)
+{
+    int64_t now;
+
+    ASSERT(tw != NULL && t != NULL && t->cb != NULL);
+
+    if (timer_pending(t)) {
+        TAILQ_REMOVE(t->slot, t, link);
+        tw->ntimer--;
+    }
+
+    now = _timer_now();
+    if (tw->ntimer == 0) {
+        /* nothing to cascade, catch up with the clock */
+        tw->now = now;
+    }
+
+    t->expire = now + MAX(timeout, 0);
+    _timer_link(tw, t);
+    tw->ntimer++;
+}
+
+void
+timer_wheel_del(struct timer_wheel *tw, struct timer *t)
+{
+    ASSERT(tw != NULL && t != NULL);
+
+    if (!timer_pending(t)) {
+        return;
+    }
+
+    TAILQ_REMOVE(t->slot, t, link);
+    t->slot = NULL;
+    tw->ntimer--;
+}
+
+int
+timer_wheel_timeout(struct timer_wheel *tw)
+{
+    int64_t now, next, base, tick;
+    int i, k, shift;
+
+    ASSERT(tw != NULL);
+
+    if (tw->ntimer == 0) {
+        return -1;
+    }
+
+    next = INT64_MAX;
+
+    for (k = 0; k < TW_ROOT_SIZE; k++) {
+        if (!TAILQ_EMPTY(&tw->root[(tw->now + k) & TW_ROOT_MASK])) {
+            next = tw->now + k;
+            break;
+        }
+    }
+
+    /*
+     * timers of the upper levels expire no earlier than the tick their
+     * slot is cascaded at, which is good enough as a wakeup
+     */
+    for (i = 0, shift = TW_ROOT_BITS; i < TW_NLEVEL; i++, shift += TW_LEVEL_BITS) {
+        base = tw->now >> shift;
+        k = (tw->now & ((1LL << shift) - 1)) == 0 ? 0 : 1;
+        for (; k <= TW_LEVEL_SIZE; k++) {
+            if (!TAILQ_EMPTY(&tw->level[i][(base + k) & TW_LEVEL_MASK])) {
+                tick = (base + k) << shift;
+                next = MIN(next, tick);
+                break;
+            }
+        }
+    }
+
+    now = _timer_now();
+    if (next <= now) {
+        return 0;
+    }
+
+    return (int)MIN(next - now, (int64_t)INT32_MAX);
+}
+
+int
+timer_wheel_expire(struct timer_wheel *tw)
+{
+    struct timer_list list;
+    struct timer *t;
+    int64_t now;
+    int i, index, nfired = 0;
+
+    ASSERT(tw != NULL);
+
+    now = _timer_now();
+
+    while (tw->ntimer > 0 && tw->now <= now) {
+        index = tw->now & TW_ROOT_MASK;
+
+        if (index == 0) {
+            for (i = 0; i < TW_NLEVEL; i++) {
+                if (_timer_cascade(tw, i, (tw->now >> (TW_ROOT_BITS + i * TW_LEVEL_BITS))
+                                   & TW_LEVEL_MASK) != 0) {
+                    break;
+                }
+            }
+        }
+
+        /*
+         * detach the slot before firing, so callbacks can add, reset or
+         * cancel any timer, including the ones still on this list
+         */
+        TAILQ_INIT(&list);
+        TAILQ_CONCAT(&list, &tw->root[index], link);
+        TAILQ_FOREACH(t, &list, link) {
+            t->slot = &list;
+        }
+        tw->now++;
+
+        while ((t = TAILQ_FIRST(&list)) != NULL) {
+            TAILQ_REMOVE(&list, t, link);
+            t->slot = NULL;
+            tw->ntimer--;
+            nfired++;
+
+            t->cb(t->arg);
+        }
+    }
+
+    if (tw->ntimer == 0 && tw->now <= now) {
+        tw->now = now + 1;
+    }
+
+    return nfired;
+}
@@ -0,0 +1,414 @@
+#include "cmn_base.h"
+#include "cmn_log.h"
+#include "cmn_upgrade.h"
+
+#include <poll.h>
+
+#define UPGRADE_MAGIC   0x75706772  /* "upgr" */
+#define UPGRADE_STATE   1           /* old -> new, descriptors attached */
+#define UPGRADE_READY   2           /* new -> old */
+
+/* one seqpacket message each way */
+struct upgrade_msg {
+    uint32_t magic;
+    uint32_t type;
+    int32_t  pid;
+    int32_t  nfd;
+    int32_t  nshm;
+    int32_t  shm_id[UPGRADE_MAX_SHM];
+    char     fd_name[UPGRADE_MAX_FD][UPGRADE_NAME_LEN];
+    char     shm_name[UPGRADE_MAX_SHM][UPGRADE_NAME_LEN];
+};
+
+static void _upgrade_accept(void *arg, uint32_t events);
+static void _upgrade_read(void *arg, uint32_t events);
+
+static const struct event_handler upgrade_listen_handler = {
+    .read  = _upgrade_accept,
+    .write = NULL,
+    .error = NULL,
+};
+
+static const struct event_handler upgrade_conn_handler = {
+    .read  = _upgrade_read,
+    .write = NULL,
+    .error = _upgrade_read,
+};
+
+static int
+_upgrade_listen(struct upgrade *u)
+{
+    if (!sock_unix_listen(u->path, SOCK_SEQPACKET, &u->l, 1)) {
+        return CMN_ERROR;
+    }
+
+    if (event_register(u->evb, u->l.sd, EVENT_READ, &upgrade_listen_handler, u) < 0) {
+        close(u->l.sd);
+        u->l.sd = -1;
+        return CMN_ERROR;
+    }
+
+    return CMN_OK;
+}
+
+static void
+_upgrade_abort(struct upgrade *u);
+
+static void
+_upgrade_timeout(void *arg)
+{
+    struct upgrade *u = arg;
+
+    log_warn("new process not ready within %lld ms", (long long)u->timeout);
+
+    _upgrade_abort(u);
+}
+
+static void
+_upgrade_close(struct upgrade *u, struct sock_conn *c)
+{
+    if (c->sd < 0) {
+        return;
+    }
+
+    event_del(u->evb, c->sd);
+    close(c->sd);
+    c->sd = -1;
+}
+
+/* the new process went away or timed out before it was ready, keep serving */
+static void
+_upgrade_abort(struct upgrade *u)
+{
+    log_warn("upgrade through '%s' aborted, keep serving", u->path);
+
+    event_timer_del(u->evb, &u->timer);
+    _upgrade_close(u, &u->c);
+
+    if (_upgrade_listen(u) != CMN_OK) {
+        log_error("upgrade listen on '%s' lost, no further upgrade possible", u->path);
+    }
+}
+
+struct upgrade *
+upgrade_create(struct event_base *evb, const char *path, int64_t timeout,
+               upgrade_fn cb, void *arg)
+{
+    struct upgrade *u;
+
+    ASSERT(evb != NULL && path != NULL && cb != NULL);
+
+    if (strlen(path) >= sizeof(u->path)) {
+        log_error("upgrade path '%s' too long", path);
+        return NULL;
+    }
+
+    u = (struct upgrade *)cmn_zalloc(sizeof(*u));
+    if (u == NULL) {
+        log_error("upgrade creation failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    u->evb = evb;
+    strcpy(u->path, path);
+    u->l.sd = -1;
+    u->c.sd = -1;
+    u->st.sd = -1;
+    u->st.pid = getpid();
+    u->timeout = timeout;
+    timer_init(&u->timer, _upgrade_timeout, u);
+    u->cb = cb;
+    u->arg = arg;
+
+    if (_upgrade_listen(u) != CMN_OK) {
+        cmn_free(u);
+        return NULL;
+    }
+
+    return u;
+}
+
+void
+upgrade_destroy(struct upgrade **u)
+{
+    struct upgrade *p = *u;
+
+    if (p == NULL) {
+        return;
+    }
+
+    event_timer_del(p->evb, &p->timer);
+    _upgrade_close(p, &p->l);
+    _upgrade_close(p, &p->c);
+
+    cmn_free(p);
+    *u = NULL;
+}
+
+static int
+_upgrade_name(char *dst, const char *name)
+{
+    if (strlen(name) >= UPGRADE_NAME_LEN) {
+        log_error("upgrade name '%s' too long", name);
+        return CMN_ERROR;
+    }
+
+    strcpy(dst, name);
+    return CMN_OK;
+}
+
+int
+upgrade_add_fd(struct upgrade *u, const char *name, int fd)
+{
+    ASSERT(fd >= 0);
+
+    if (u->st.nfd >= UPGRADE_MAX_FD) {
+        log_error("upgrade of fd '%s' failed: at most %d fds", name, UPGRADE_MAX_FD);
+        return CMN_ERROR;
+    }
+
+    if (_upgrade_name(u->st.fd_name[u->st.nfd], name) != CMN_OK) {
+        return CMN_ERROR;
+    }
+
+    u->st.fd[u->st.nfd++] = fd;
+
+    return CMN_OK;
+}
+
+int
+upgrade_add_shm(struct upgrade *u, const char *name, int sid)
+{
+    ASSERT(sid >= 0);
+
+    if (u->st.nshm >= UPGRADE_MAX_SHM) {
+        log_error("upgrade of shm '%s' failed: at most %d segments", name,
+                  UPGRADE_MAX_SHM);
+        return CMN_ERROR;
+    }
+
+    if (_upgrade_name(u->st.shm_name[u->st.nshm], name) != CMN_OK) {
+        return CMN_ERROR;
+    }
+
+    u->st.shm_id[u->st.nshm++] = sid;
+
+    return CMN_OK;
+}
+
+static void
+_upgrade_accept(void *arg, uint32_t events)
+{
+    struct upgrade *u = arg;
+    struct upgrade_msg msg;
+    int sd, i;
+
+    if (sock_accept_batch(&u->l, &sd, 1) != 1) {
+        return;
+    }
+
+    /* one upgrade at a time, and path is free for the new process */
+    _upgrade_close(u, &u->l);
+    u->c.sd = sd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = UPGRADE_MAGIC;
+    msg.type = UPGRADE_STATE;
+    msg.pid = (int32_t)u->st.pid;
+    msg.nfd = u->st.nfd;
+    msg.nshm = u->st.nshm;
+    memcpy(msg.fd_name, u->st.fd_name, sizeof(msg.fd_name));
+    memcpy(msg.shm_name, u->st.shm_name, sizeof(msg.shm_name));
+    for (i = 0; i < u->st.nshm; i++) {
+        msg.shm_id[i] = u->st.shm_id[i];
+    }
+
+    if (sock_send_fds(&u->c, &msg, sizeof(msg), u->st.fd, u->st.nfd) !=
+        (int)sizeof(msg)) {
+        _upgrade_abort(u);
+        return;
+    }
+
+    if (event_register(u->evb, u->c.sd, EVENT_READ, &upgrade_conn_handler, u) < 0) {
+        _upgrade_abort(u);
+        return;
+    }
+
+    /* a new process stuck before ready must not block further upgrades */
+    if (u->timeout >= 0) {
+        event_timer_add(u->evb, &u->timer, u->timeout);
+    }
+
+    log_info("upgrade state of %d fds %d shm handed off through '%s'",
+             u->st.nfd, u->st.nshm, u->path);
+}
+
+static void
+_upgrade_read(void *arg, uint32_t events)
+{
+    struct upgrade *u = arg;
+    struct upgrade_msg msg;
+    ssize_t n;
+
+    n = recv(u->c.sd, &msg, sizeof(msg), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+
+    if (n != (ssize_t)sizeof(msg) || msg.magic != UPGRADE_MAGIC ||
+        msg.type != UPGRADE_READY) {
+        _upgrade_abort(u);
+        return;
+    }
+
+    event_timer_del(u->evb, &u->timer);
+    _upgrade_close(u, &u->c);
+
+    log_info("upgrade to pid %d ready, draining", msg.pid);
+
+    u->cb(u->arg);
+}
+
+static void
+_upgrade_close_fds(int *fd, int nfd)
+{
+    int i;
+
+    for (i = 0; i < nfd; i++) {
+        close(fd[i]);
+    }
+}
+
+int
+upgrade_takeover(const char *path, int64_t timeout, struct upgrade_state *st)
+{
+    struct sock_conn c;
+    struct upgrade_msg msg;
+    struct pollfd pfd;
+    int64_t deadline, wait;
+    int n, nfd, i;
+
+    ASSERT(path != NULL && st != NULL);
+
+    memset(st, 0, sizeof(*st));
+    st->sd = -1;
+
+    memset(&c, 0, sizeof(c));
+    if (!sock_unix_connect(path, SOCK_SEQPACKET, &c)) {
+        if (c.err == ECONNREFUSED || c.err == ENOENT) {
+            log_info("no process to take over on '%s', cold start", path);
+            return CMN_NOKEY;
+        }
+        return CMN_ERROR;
+    }
+
+    /* a negative timeout waits without limit, as in upgrade_create */
+    deadline = cmn_usec_mono() / 1000 + timeout;
+
+    for (;;) {
+        nfd = UPGRADE_MAX_FD;
+        n = sock_recv_fds(&c, &msg, sizeof(msg), st->fd, &nfd);
+        if (n != CMN_EAGAIN) {
+            break;
+        }
+
+        pfd.fd = c.sd;
+        pfd.events = POLLIN;
+        wait = -1;
+        if (timeout >= 0) {
+            wait = MIN(deadline - cmn_usec_mono() / 1000, INT_MAX);
+        }
+        if ((timeout >= 0 && wait <= 0) || poll(&pfd, 1, (int)wait) == 0) {
+            log_error("take over on '%s' timed out", path);
+            close(c.sd);
+            return CMN_ERROR;
+        }
+    }
+
+    if (n != (int)sizeof(msg) || msg.magic != UPGRADE_MAGIC ||
+        msg.type != UPGRADE_STATE || msg.nfd != nfd ||
+        msg.nshm < 0 || msg.nshm > UPGRADE_MAX_SHM) {
+        log_error("take over on '%s' failed: bad state message of %d bytes", path, n);
+        if (n > 0) {
+            _upgrade_close_fds(st->fd, nfd);
+        }
+        close(c.sd);
+        return CMN_ERROR;
+    }
+
+    st->nfd = nfd;
+    st->nshm = msg.nshm;
+    st->pid = (pid_t)msg.pid;
+    st->sd = c.sd;
+    memcpy(st->fd_name, msg.fd_name, sizeof(st->fd_name));
+    memcpy(st->shm_name, msg.shm_name, sizeof(st->shm_name));
+    for (i = 0; i < st->nshm; i++) {
+        st->shm_id[i] = msg.shm_id[i];
+    }
+    for (i = 0; i < UPGRADE_MAX_FD; i++) {
+        st->fd_name[i][UPGRADE_NAME_LEN - 1] = '\0';
+    }
+    for (i = 0; i < UPGRADE_MAX_SHM; i++) {
+        st->shm_name[i][UPGRADE_NAME_LEN - 1] = '\0';
+    }
+
+    log_info("took over %d fds %d shm from pid %d on '%s'", st->nfd, st->nshm,
+             st->pid, path);
+
+    return CMN_OK;
+}
+
+int
+upgrade_fd(const struct upgrade_state *st, const char *name)
+{
+    int i;
+
+    for (i = 0; i < st->nfd; i++) {
+        if (strcmp(st->fd_name[i], name) == 0) {
+            return st->fd[i];
+        }
+    }
+
+    return -1;
+}
+
+int
+upgrade_shm(const struct upgrade_state *st, const char *name)
+{
+    int i;
+
+    for (i = 0; i < st->nshm; i++) {
+        if (strcmp(st->shm_name[i], name) == 0) {
+            return st->shm_id[i];
+        }
+    }
+
+    return -1;
+}
+
+int
+upgrade_ready(struct upgrade_state *st)
+{
+    struct upgrade_msg msg;
+    ssize_t n;
+
+    if (st->sd < 0) {
+        return CMN_OK;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = UPGRADE_MAGIC;
+    msg.type = UPGRADE_READY;
+    msg.pid = (int32_t)getpid();
+
+    /* the socket is nonblocking, but its queue is empty */
+    n = send(st->sd, &msg, sizeof(msg), MSG_NOSIGNAL);
+    if (n != (ssize_t)sizeof(msg)) {
+        log_error("upgrade ready to pid %d failed: %s", st->pid, strerror(errno));
+    }
+
+    close(st->sd);
+    st->sd = -1;
+
+    return n == (ssize_t)sizeof(msg) ? CMN_OK : CMN_ERROR;
+}
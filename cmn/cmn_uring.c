@@ -0,0 +1,236 @@
+#include "cmn_base.h"
+#include "cmn_log.h"
+#include "cmn_uring.h"
+
+#include <sys/syscall.h>
+
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_EXT_ARG)
+
+static int
+_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+             void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                        arg, argsz);
+}
+
+int
+uring_init(struct uring *ur, unsigned entries)
+{
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+    unsigned i;
+
+    ASSERT(ur != NULL && entries > 0);
+
+    memset(ur, 0, sizeof(*ur));
+    ur->fd = -1;
+
+    memset(&p, 0, sizeof(p));
+    ur->fd = _uring_setup(entries, &p);
+    if (ur->fd < 0) {
+        log_warn("io_uring setup with %u entries failed: %s", entries, strerror(errno));
+        return CMN_ERROR;
+    }
+
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        log_warn("io_uring features %x lack ext arg or nodrop", p.features);
+        close(ur->fd);
+        ur->fd = -1;
+        errno = ENOSYS;
+        return CMN_ERROR;
+    }
+
+    ur->features = p.features;
+    ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->sq_ring_size = MAX(ur->sq_ring_size, ur->cq_ring_size);
+        ur->cq_ring_size = 0;
+    }
+
+    ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if (ur->sq_ring == MAP_FAILED) {
+        ur->sq_ring = NULL;
+        goto error;
+    }
+
+    if (ur->cq_ring_size == 0) {
+        ur->cq_ring = ur->sq_ring;
+    } else {
+        ur->cq_ring = mmap(NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+        if (ur->cq_ring == MAP_FAILED) {
+            ur->cq_ring = NULL;
+            goto error;
+        }
+    }
+
+    ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED) {
+        ur->sqes = NULL;
+        goto error;
+    }
+
+    sq = ur->sq_ring;
+    ur->sq_entries = p.sq_entries;
+    ur->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ur->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ur->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    cq = ur->cq_ring;
+    ur->cq_entries = p.cq_entries;
+    ur->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ur->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ur->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* sqes are always used in ring order */
+    for (i = 0; i < ur->sq_entries; i++) {
+        ur->sq_array[i] = i;
+    }
+
+    ur->sqe_head = ur->sqe_tail = *ur->sq_tail;
+
+    log_info("io_uring fd %d with %u sq and %u cq entries", ur->fd, ur->sq_entries,
+             ur->cq_entries);
+
+    return CMN_OK;
+
+error:
+    log_error("io_uring mmap on fd %d failed: %s", ur->fd, strerror(errno));
+    uring_exit(ur);
+    return CMN_ERROR;
+}
+
+void
+uring_exit(struct uring *ur)
+{
+    if (ur->sqes != NULL) {
+        munmap(ur->sqes, ur->sqes_size);
+        ur->sqes = NULL;
+    }
+
+    if (ur->cq_ring != NULL && ur->cq_ring != ur->sq_ring) {
+        munmap(ur->cq_ring, ur->cq_ring_size);
+    }
+    ur->cq_ring = NULL;
+
+    if (ur->sq_ring != NULL) {
+        munmap(ur->sq_ring, ur->sq_ring_size);
+        ur->sq_ring = NULL;
+    }
+
+    if (ur->fd >= 0) {
+        if (close(ur->fd) < 0) {
+            log_warn("close io_uring fd %d failed, ignored: %s", ur->fd, strerror(errno));
+        }
+        ur->fd = -1;
+    }
+}
+
+struct io_uring_sqe *
+uring_get_sqe(struct uring *ur)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ur->sqe_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries) {
+        if (uring_enter(ur, 0, 0) < 0 ||
+            ur->sqe_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries) {
+            log_error("io_uring fd %d submission queue is full", ur->fd);
+            return NULL;
+        }
+    }
+
+    sqe = &ur->sqes[ur->sqe_tail & *ur->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ur->sqe_tail++;
+
+    return sqe;
+}
+
+int
+uring_enter(struct uring *ur, unsigned min_complete, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned to_submit, flags;
+    int n;
+
+    to_submit = ur->sqe_tail - ur->sqe_head;
+    if (to_submit > 0) {
+        __atomic_store_n(ur->sq_tail, ur->sqe_tail, __ATOMIC_RELEASE);
+    }
+
+    flags = 0;
+    memset(&arg, 0, sizeof(arg));
+
+    if (min_complete > 0 && timeout != 0 && uring_cq_ready(ur) == 0) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout > 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (long long)(timeout % 1000) * 1000000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    } else {
+        min_complete = 0;
+        if (to_submit == 0) {
+            return 0;
+        }
+    }
+
+    n = _uring_enter(ur->fd, to_submit, min_complete, flags,
+                     (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+                     (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+    if (n < 0) {
+        return CMN_ERROR;
+    }
+
+    ur->sqe_head += (unsigned)n;
+
+    return n;
+}
+
+#else
+
+int
+uring_init(struct uring *ur, unsigned entries)
+{
+    memset(ur, 0, sizeof(*ur));
+    ur->fd = -1;
+    errno = ENOSYS;
+
+    return CMN_ERROR;
+}
+
+void
+uring_exit(struct uring *ur)
+{
+}
+
+struct io_uring_sqe *
+uring_get_sqe(struct uring *ur)
+{
+    return NULL;
+}
+
+int
+uring_enter(struct uring *ur, unsigned min_complete, int timeout)
+{
+    errno = ENOSYS;
+
+    return CMN_ERROR;
+}
+
+#endif
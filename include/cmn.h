@@ -54,6 +54,7 @@
 #define MAX_HOSTNAME_LEN (256)
 
 #define CMN_ALIGNMENT        sizeof(unsigned long)
+#define CMN_CACHELINE_SIZE   64
 #define CMN_ALIGN(d, n)      (((d) + (n - 1)) & ~(n - 1))
 #define CMN_ALIGN_PTR(p, n)  \
     (void *) (((uintptr_t) (p) + ((uintptr_t) n - 1)) & ~((uintptr_t) n - 1))
@@ -132,6 +132,7 @@ int _scnprintf(char *buf, size_t size, const char *fmt, ...);
 int _vscnprintf(char *buf, size_t size, const char *fmt, va_list args);
 
 int64_t cmn_usec_now(void);
+int64_t cmn_usec_mono(void);
 void *cmn_mmap(size_t size, const char *name, int line);
 int cmn_munmap(void *p, size_t size, const char *name, int line);
 
@@ -0,0 +1,79 @@
+#ifndef __CMN_CONNPOOL_H
+#define __CMN_CONNPOOL_H
+
+#include "cmn_base.h"
+#include "cmn_log.h"
+#include "cmn_queue.h"
+#include "cmn_event.h"
+#include "cmn_sock.h"
+
+/*
+ * connection pool of one destination, owned by the loop of one event base
+ *
+ * released connections are kept on an idle list (most recently used first)
+ * and handed out again after a liveness check, so steady state requests
+ * skip the handshake. failed connects back the pool off exponentially.
+ */
+
+/* got connection c, or err (errno) and c NULL */
+typedef void (*connpool_fn)(struct sock_conn *c, int err, void *arg);
+
+struct connpool_conf {
+    int     max_idle;           /* max # idle connections kept */
+    int     max_active;         /* max # connections in use or connecting */
+    int64_t idle_timeout;       /* ms an idle connection is kept, 0 for no expiry */
+    int64_t connect_timeout;    /* ms, -1 for none */
+    int64_t backoff_min;        /* ms of the first back-off after a failure, >= 1 */
+    int64_t backoff_max;        /* ms the back-off doubles up to, 0 for none */
+    const struct sock_profile *profile; /* options of new connections, or NULL */
+};
+
+struct connpool_conn;
+TAILQ_HEAD(connpool_list, connpool_conn);
+
+struct connpool {
+    struct event_base       *evb;
+    struct sockaddr_storage addr;       /* destination */
+    socklen_t               addrlen;
+    int                     family;
+    struct connpool_conf    conf;
+    struct connpool_list    idle;       /* idle[] - most recently used first */
+    struct connpool_list    connecting; /* connects in flight */
+    int                     nidle;      /* # idle connections */
+    int                     nactive;    /* # connections in use or connecting */
+    int64_t                 backoff;    /* ms of the current back-off, 0 if none */
+    int64_t                 retry_at;   /* ms (monotonic) before no connect is tried */
+    struct timer            reap;       /* closes expired idle connections */
+    uint64_t                nreuse;     /* # gets served from the idle list */
+    uint64_t                nconnect;   /* # connects started */
+    uint64_t                nfail;      /* # connects failed */
+};
+
+struct connpool *
+connpool_create(struct event_base *evb, struct addrinfo *ai,
+                const struct connpool_conf *conf);
+
+/*
+ * close the idle connections and cancel the connects in flight, whose
+ * callbacks then never run; connections in use must be put back first
+ */
+void
+connpool_destroy(struct connpool **pool);
+
+/*
+ * get a connection: a live idle one is passed to cb before connpool_get
+ * returns, else a connect is started and cb runs on completion. returns
+ * CMN_EAGAIN when max_active connections are out, CMN_ERROR while the
+ * pool backs off after a failed connect
+ */
+int
+connpool_get(struct connpool *pool, connpool_fn cb, void *arg);
+
+/*
+ * give back c, which must be unregistered from the event base; it is kept
+ * for reuse if is_reusable, it has no error and the idle list has room
+ */
+void
+connpool_put(struct connpool *pool, struct sock_conn *c, bool is_reusable);
+
+#endif
@@ -3,6 +3,66 @@
 
 #include "cmn.h"
 
+struct event_base;
+
 int daemon_init(bool is_open, char *chdir);
 
+/*
+ * handle the log signals in the loop of evb: SIGHUP reopens the log,
+ * SIGTTIN and SIGTTOU raise and lower the log level; SIGPIPE is ignored
+ */
+int daemon_signal_init(struct event_base *evb);
+
+/*
+ * prefork process model: a master forks nworker workers and respawns the
+ * ones that exit, backing off when a worker dies within stable ms of its
+ * start. listeners opened before daemon_prefork are shared by all workers,
+ * for SO_REUSEPORT each worker opens its own in fn. workers publish health
+ * and load in a segment shared with the master, which logs them every
+ * report ms and warns about workers silent for longer than hang ms.
+ *
+ * the master forwards SIGTERM, SIGINT, SIGHUP, SIGTTIN and SIGTTOU to the
+ * workers. a worker starts with SIGHUP, SIGTTIN and SIGTTOU ignored and
+ * SIGTERM, SIGINT at their default action; it calls daemon_signal_init on
+ * its own event base to honour the log signals.
+ */
+#define DAEMON_MAX_WORKER 256
+
+struct daemon_prefork_conf {
+    int     nworker;        /* # workers, 0 for one per cpu */
+    bool    is_pin;         /* pin worker id to cpu id % # cpus */
+    int64_t backoff_min;    /* ms before the first respawn of a failing worker, >= 1 */
+    int64_t backoff_max;    /* ms the respawn back-off doubles up to */
+    int64_t stable;         /* ms a worker must run to reset its back-off */
+    int64_t report;         /* ms between health reports, 0 for none */
+    int64_t hang;           /* ms without daemon_worker_report to warn, 0 for none */
+};
+
+/* slot of one worker in the shared segment, cache line aligned */
+struct daemon_worker {
+    volatile pid_t    pid;          /* 0 if not running */
+    volatile int      cpu;          /* pinned cpu, -1 if none */
+    volatile int64_t  heartbeat;    /* ms (monotonic) of the last report */
+    volatile uint64_t load;         /* e.g. # connections */
+    volatile uint64_t nrequest;     /* # requests served */
+    volatile uint32_t nspawn;       /* # times started */
+} __attribute__((aligned(CMN_CACHELINE_SIZE)));
+
+/* body of worker id, its return value is the exit status */
+typedef int (*daemon_worker_fn)(int id, void *arg);
+
+/*
+ * run the master until SIGTERM or SIGINT, which are forwarded to the
+ * workers; returns once all of them have exited. if its event loop keeps
+ * failing the master stops the workers itself and returns CMN_ERROR. never
+ * returns in a worker
+ */
+int daemon_prefork(const struct daemon_prefork_conf *conf, daemon_worker_fn fn, void *arg);
+
+/* in a worker, publish its load and refresh its heartbeat */
+void daemon_worker_report(uint64_t load, uint64_t nrequest);
+
+/* the shared slots and their #, NULL outside daemon_prefork */
+struct daemon_worker *daemon_workers(int *nworker);
+
 #endif
@@ -1,24 +1,190 @@
-#ifndef __CMN_DAEMON_H
-#define __CMN_DAEMON_H
+#ifndef __CMN_EVENT_H
+#define __CMN_EVENT_H
 
 #include "cmn_base.h"
 #include "cmn_log.h"
+#include "cmn_timer.h"
+#include "cmn_metric.h"
 
 #define EVENT_READ  0x0000ff
 #define EVENT_WRITE 0x00ff00
 #define EVENT_ERR   0xff0000
 
+/*
+ * registration modes, or'ed into the events of event_add/event_mod
+ *
+ * EVENT_ET        - edge triggered, fd is reported once per readiness change
+ *                   and must be drained until EAGAIN
+ * EVENT_ONESHOT   - fd is disabled after one report until event_rearm, so a
+ *                   callback finishes before the fd is reported again
+ * EVENT_EXCLUSIVE - for one fd (e.g. a listener) added to several event bases,
+ *                   wake only one of them; can not be used with EVENT_ONESHOT
+ */
+#define EVENT_ET        0x01000000
+#define EVENT_ONESHOT   0x02000000
+#define EVENT_EXCLUSIVE 0x04000000
+#define EVENT_MODE      (EVENT_ET | EVENT_ONESHOT | EVENT_EXCLUSIVE)
+
+/*
+ * backends, EVENT_BACKEND_URING falls back to epoll when the kernel has no
+ * usable io_uring; EVENT_ET and EVENT_EXCLUSIVE are epoll only
+ */
+#define EVENT_BACKEND_EPOLL 0
+#define EVENT_BACKEND_URING 1
+
+/*
+ * event loop instrumentation, enabled by event_base_metrics
+ *
+ * loop lag is the time between two event_wait calls, i.e. the work the
+ * caller does between waits. the nevent_* and cb_* metrics are histograms
+ * of events returned per wakeup and of the latency of each I/O callback.
+ * the *_max peaks cover the time since the last event_metrics_snapshot,
+ * cb_max_data tells which registration the slowest callback belonged to.
+ */
+#define EVENT_METRIC(ACTION)                                                      \
+    ACTION( event_wait,         METRIC_COUNTER, "# event_wait calls"             )\
+    ACTION( event_wait_us,      METRIC_COUNTER, "us blocked in the backend wait" )\
+    ACTION( event_cb_us,        METRIC_COUNTER, "us in callbacks, tasks, timers" )\
+    ACTION( event_loop_lag_us,  METRIC_GAUGE,   "us between the last two waits"  )\
+    ACTION( event_loop_lag_max, METRIC_GAUGE,   "max loop lag since snapshot"    )\
+    ACTION( event_nevent_0,     METRIC_COUNTER, "# wakeups with no event"        )\
+    ACTION( event_nevent_1,     METRIC_COUNTER, "# wakeups with 1 event"         )\
+    ACTION( event_nevent_4,     METRIC_COUNTER, "# wakeups with 2-4 events"      )\
+    ACTION( event_nevent_16,    METRIC_COUNTER, "# wakeups with 5-16 events"     )\
+    ACTION( event_nevent_64,    METRIC_COUNTER, "# wakeups with 17-64 events"    )\
+    ACTION( event_nevent_inf,   METRIC_COUNTER, "# wakeups with > 64 events"     )\
+    ACTION( event_cb_10us,      METRIC_COUNTER, "# callbacks < 10us"             )\
+    ACTION( event_cb_100us,     METRIC_COUNTER, "# callbacks 10us-100us"         )\
+    ACTION( event_cb_1ms,       METRIC_COUNTER, "# callbacks 100us-1ms"          )\
+    ACTION( event_cb_10ms,      METRIC_COUNTER, "# callbacks 1ms-10ms"           )\
+    ACTION( event_cb_inf,       METRIC_COUNTER, "# callbacks >= 10ms"            )\
+    ACTION( event_cb_max_us,    METRIC_GAUGE,   "max callback us since snapshot" )\
+    ACTION( event_busy_hit,     METRIC_COUNTER, "# busy polls that found work"   )\
+    ACTION( event_busy_miss,    METRIC_COUNTER, "# busy polls that fell back"    )\
+    ACTION( event_busy_us,      METRIC_COUNTER, "us spent busy polling"          )\
+    ACTION( event_busy_budget,  METRIC_GAUGE,   "current busy poll budget in us" )
+
+struct event_metrics {
+    EVENT_METRIC(METRIC_DECLARE)
+    void *cb_max_data;  /* data of the event_cb_max_us callback, not a metric */
+};
+
 typedef void (*event_cb_fn)(void *, uint32_t);  /* event callback */
+typedef void (*event_io_fn)(void *, int);       /* io callback, res or -errno */
+typedef void (*event_task_fn)(void *);          /* posted task */
+typedef void (*event_signal_fn)(void *, int);   /* signal callback, gets signo */
 
 struct event_base;
 
+/*
+ * per fd callbacks, each gets the data of the registration and the EVENT_*
+ * mask. EVENT_ERR goes to error if set, else to read and write.
+ */
+struct event_handler {
+    event_cb_fn read;
+    event_cb_fn write;
+    event_cb_fn error;
+};
+
 struct event_base *event_base_create(int nevent, event_cb_fn cb);
+struct event_base *event_base_create_backend(int nevent, event_cb_fn cb, int backend);
 void event_base_destroy(struct event_base **evb);
 
+/* backend actually in use */
+int event_base_backend(struct event_base *evb);
+
+/*
+ * export loop metrics into m (initialized by EVENT_METRIC(METRIC_INIT)),
+ * NULL turns them off; when off the loop takes no timestamps at all
+ */
+void event_base_metrics(struct event_base *evb, struct event_metrics *m);
+
+/*
+ * copy m into dst for export and restart the peaks, so each snapshot reports
+ * the worst since the one before; callable from any thread
+ */
+void event_metrics_snapshot(struct event_metrics *dst, struct event_metrics *m);
+
+/*
+ * busy poll: before blocking, event_wait polls the backend without sleeping
+ * for up to a budget of at most max_us microseconds, 0 turns it off. the
+ * budget doubles when a poll finds work and halves when it runs out, so the
+ * loop only burns CPU while events arrive faster than the budget. pair it
+ * with sock_set_busy_poll on the sockets to also spin in the driver.
+ */
+void event_base_busy_poll(struct event_base *evb, int max_us);
+
+/*
+ * event_add     - add events (EVENT_READ and/or EVENT_WRITE) to the interest of fd
+ * event_mod     - replace the interest of fd with events, 0 removes fd
+ * event_del_*   - drop read or write from the interest of fd
+ * event_del     - remove fd, must be called before fd is closed
+ *
+ * the interest of every fd is tracked, so calls that do not change it
+ * cost no epoll_ctl
+ */
+int event_add(struct event_base *evb, int fd, uint32_t events, void *data);
+int event_mod(struct event_base *evb, int fd, uint32_t events, void *data);
 int event_add_read(struct event_base *evb, int fd, void *data);
 int event_add_write(struct event_base *evb, int fd, void *data);
+int event_del_read(struct event_base *evb, int fd);
+int event_del_write(struct event_base *evb, int fd);
 int event_del(struct event_base *evb, int fd);
 
+/*
+ * like event_mod, but events of fd are dispatched straight to h instead of
+ * the callback of the event base; h must outlive the registration
+ */
+int event_register(struct event_base *evb, int fd, uint32_t events,
+                   const struct event_handler *h, void *data);
+
+/* re-enable a EVENT_ONESHOT fd with its registered interest */
+int event_rearm(struct event_base *evb, int fd);
+
+/* registered interest of fd */
+uint32_t event_interest(struct event_base *evb, int fd);
+
+/*
+ * timers owned by the event base, t is set up by timer_init and fired by
+ * event_wait after the I/O callbacks; adding a pending timer reschedules it
+ */
+void event_timer_add(struct event_base *evb, struct timer *t, int64_t timeout);
+void event_timer_del(struct event_base *evb, struct timer *t);
+
+/*
+ * completion based io, cb gets the syscall result (bytes, accepted fd) or
+ * -errno, a timeout completes with -ETIME. like read(2) a request may
+ * transfer less than len, on io_uring at most UINT32_MAX bytes
+ *
+ * on io_uring requests are batched and submitted by the next event_wait. on
+ * epoll they are emulated: the fd is watched for readiness and the syscall
+ * runs in event_wait, so only one read (or accept) and one write may be in
+ * flight per fd, and such an fd must not be registered by event_add as well.
+ */
+int event_submit_read(struct event_base *evb, int fd, void *buf, size_t len,
+                      event_io_fn cb, void *arg);
+int event_submit_write(struct event_base *evb, int fd, void *buf, size_t len,
+                       event_io_fn cb, void *arg);
+int event_submit_accept(struct event_base *evb, int fd, event_io_fn cb, void *arg);
+int event_submit_timeout(struct event_base *evb, int64_t timeout, event_io_fn cb, void *arg);
+
+/*
+ * run fn(arg) on the loop thread of evb, callable from any thread; tasks run
+ * in event_wait after the I/O callbacks. the loop is only woken (one eventfd
+ * write) when it is sleeping and has not been woken already.
+ */
+int event_post(struct event_base *evb, event_task_fn fn, void *arg);
+
+/*
+ * handle signo in the loop: the signal is blocked in the calling thread and
+ * read from a signalfd, so cb runs like any other callback and may take
+ * locks or allocate. threads inherit the mask, so add signals before other
+ * threads are created, else they can still take the signal asynchronously.
+ * event_signal_del unblocks signo again.
+ */
+int event_signal_add(struct event_base *evb, int signo, event_signal_fn cb, void *arg);
+int event_signal_del(struct event_base *evb, int signo);
+
 /* event wait */
 int event_wait(struct event_base *evb, int timeout);
 
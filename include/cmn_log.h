@@ -5,6 +5,10 @@
 
 #define LOG_MAX_LEN 512 /* max length of log message */
 
+#define LOG_ASYNC_NRECORD   4096    /* default # records queued for the writer */
+#define LOG_ASYNC_BATCH     64      /* max # records per writev */
+#define LOG_ASYNC_WAIT      100     /* max ms the writer sleeps */
+
 #define LOG_EMERG   0   /* system in unusable */
 #define LOG_ALERT   1   /* action must be taken immediately */
 #define LOG_ERR     2   /* error conditions */
@@ -128,6 +132,19 @@ void log_level_up(void);
 void log_level_down(void);
 void log_level_set(int level);
 void log_reopen(void);
+
+/*
+ * asynchronous mode: lines are formatted into a bounded lock-free queue of
+ * nrecord records (0 for the default) and written in batches by a writer
+ * thread. a line that finds the queue full is dropped and counted; a panic
+ * flushes the queue and is written synchronously. a forked child logs
+ * synchronously, log_async_child restarts the writer there if the parent
+ * ran one. log_close stops the writer and must not race other loggers
+ */
+int log_async(uint32_t nrecord);
+int log_async_child(void);
+void log_flush(void);
+uint64_t log_dropped(void);
 void log_stacktrace(void);
 int log_loggable(int level);
 void _log_stderr(const char *fmt, ...);
@@ -0,0 +1,86 @@
+#ifndef __CMN_MPSC_H
+#define __CMN_MPSC_H
+
+#include "cmn.h"
+
+/*
+ * intrusive multi-producer single-consumer queue (Vyukov)
+ *
+ * any thread may push, a push is one atomic exchange and never blocks. only
+ * one thread may pop. a pop can return NULL while a push is halfway done, so
+ * the consumer should check mpsc_empty before going to sleep.
+ */
+struct mpsc_node {
+    struct mpsc_node *next;
+};
+
+struct mpsc_queue {
+    struct mpsc_node *head;   /* last pushed, shared by producers */
+    struct mpsc_node *tail;   /* next to pop, consumer only */
+    struct mpsc_node stub;
+};
+
+static inline void
+mpsc_init(struct mpsc_queue *q)
+{
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+static inline void
+mpsc_push(struct mpsc_queue *q, struct mpsc_node *n)
+{
+    struct mpsc_node *prev;
+
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&q->head, n, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+static inline bool
+mpsc_empty(struct mpsc_queue *q)
+{
+    return q->tail == &q->stub &&
+           __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == &q->stub;
+}
+
+static inline struct mpsc_node *
+mpsc_pop(struct mpsc_queue *q)
+{
+    struct mpsc_node *tail = q->tail;
+    struct mpsc_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    struct mpsc_node *head;
+
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (tail != head) {
+        /* a producer is between its exchange and its link */
+        return NULL;
+    }
+
+    mpsc_push(q, &q->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+#endif
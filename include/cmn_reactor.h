@@ -0,0 +1,76 @@
+#ifndef __CMN_REACTOR_H
+#define __CMN_REACTOR_H
+
+#include "cmn_base.h"
+#include "cmn_log.h"
+#include "cmn_event.h"
+#include "cmn_sock.h"
+
+struct reactor;
+struct reactor_group;
+
+/*
+ * called on the accepting reactor for every new connection, the callee owns
+ * c and registers it on reactor_event_base(r), so a connection never leaves
+ * the loop that accepted it. c comes from the sock_conn pool of r, so it
+ * must be given back by sock_conn_destroy on that loop
+ */
+typedef void (*reactor_accept_fn)(struct reactor *r, struct sock_conn *c);
+
+struct reactor {
+    int                  id;        /* index in the group */
+    int                  cpu;       /* cpu the thread is pinned to, -1 if not */
+    pthread_t            tid;       /* loop thread */
+    bool                 is_running;
+    struct event_base    *evb;      /* event loop of this reactor */
+    struct sock_conn     listener;  /* own SO_REUSEPORT listening socket */
+    struct reactor_group *group;
+    struct sock_conn_pool *conns;   /* connections accepted by this reactor */
+    uint64_t             naccept;   /* # accepted connections */
+};
+
+struct reactor_group {
+    int                  nreactor;  /* # reactors */
+    int                  is_stop;   /* set to stop every loop */
+    event_cb_fn          cb;        /* callback of connection events */
+    reactor_accept_fn    accept;    /* callback of new connections */
+    void                 *data;     /* user data */
+    struct reactor       *reactors; /* reactors[] */
+};
+
+static inline struct event_base *
+reactor_event_base(struct reactor *r)
+{
+    return r->evb;
+}
+
+static inline void *
+reactor_data(struct reactor *r)
+{
+    return r->group->data;
+}
+
+/*
+ * create nreactor event loops each listening on ai, reactor i is pinned to
+ * cpu i % online cpus
+ */
+struct reactor_group *
+reactor_group_create(int nreactor, int nevent, struct addrinfo *ai, int max_backlog,
+                     event_cb_fn cb, reactor_accept_fn accept, void *data);
+
+void
+reactor_group_destroy(struct reactor_group **group);
+
+/* start one thread per reactor */
+int
+reactor_group_start(struct reactor_group *group);
+
+/* stop and join every reactor thread */
+void
+reactor_group_stop(struct reactor_group *group);
+
+/* reactor of the calling thread, NULL outside of a reactor loop */
+struct reactor *
+reactor_self(void);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __CMN_RESOLVE_H
+#define __CMN_RESOLVE_H
+
+#include "cmn_base.h"
+#include "cmn_log.h"
+#include "cmn_event.h"
+#include "cmn_sock.h"
+
+/*
+ * name resolution cache in front of sock_resolve
+ *
+ * answers are kept for ttl ms and failures for neg_ttl ms (getaddrinfo has
+ * no record ttl), the least recently used entry makes room for a new one.
+ * misses of resolve_async are looked up by helper threads, so a loop never
+ * blocks on the resolver; concurrent misses of one name share one lookup.
+ * every call is thread safe.
+ */
+
+#define RESOLVE_TTL         60000   /* default ms an answer is cached */
+#define RESOLVE_NEG_TTL     5000    /* default ms a failure is cached */
+#define RESOLVE_MAX_ENTRY   4096    /* default max # cached names */
+#define RESOLVE_NTHREAD     4       /* default # helper threads */
+
+/* status is CMN_OK with sa filled, or CMN_ERROR if name does not resolve */
+typedef void (*resolve_fn)(int status, struct sock_addr *sa, void *arg);
+
+/* configure the cache and the # helper threads (0 for the default) */
+int resolve_setup(int64_t ttl, int64_t neg_ttl, uint32_t max_entry, int nthread);
+
+/* stop the helper threads and drop the cache, pending lookups are dropped */
+void resolve_teardown(void);
+
+/* cache only: CMN_OK, CMN_ERROR for a cached failure or CMN_NOKEY on a miss */
+int resolve_lookup(const char *name, int port, bool is_ipv4, struct sock_addr *sa);
+
+/* blocking resolve through the cache */
+int resolve_cached(const char *name, int port, bool is_ipv4, struct sock_addr *sa);
+
+/*
+ * resolve name without blocking: cached answers and numeric addresses are
+ * passed to cb before resolve_async returns, else a helper thread resolves
+ * name and cb runs on the loop of evb through event_post
+ */
+int resolve_async(struct event_base *evb, const char *name, int port, bool is_ipv4,
+                  resolve_fn cb, void *arg);
+
+#endif
@@ -3,18 +3,164 @@
 
 #include "cmn_base.h"
 #include "cmn_log.h"
+#include "cmn_rbuf.h"
+#include "cmn_metric.h"
 #include <netdb.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 
 #define CRLF                "\x0d\x0a"
 
+#define SOCK_MAX_BATCH      64      /* max # datagrams per recvmmsg/sendmmsg */
+#define SOCK_MAX_FDS        16      /* max # descriptors per sock_send_fds */
+
+#ifdef IOV_MAX
+# define SOCK_IOV_MAX       IOV_MAX
+#else
+# define SOCK_IOV_MAX       1024
+#endif
+
+struct event_base;
+struct sock_connecting;
+struct sock_conn_pool;
+
 struct sock_conn {
     bool     is_listen;
+    bool     is_nodelay;     /* TCP_NODELAY set as asked, accepted sockets inherit it */
     int      sd;             /* socket descriptor */
     int      err;
     size_t   recv_nbyte;     /* received (read) bytes */
     size_t   send_nbyte;     /* sent (written) bytes */
     void     *data;
+    struct iovec *oq;        /* oq[] - output queued by sock_queue */
+    int      noq;            /* # queued buffers */
+    int      oq_size;        /* # slots of oq */
+    size_t   oq_nbyte;       /* queued bytes not yet sent */
+    uint32_t zc_next;        /* id of the next MSG_ZEROCOPY send */
+    uint32_t zc_done;        /* MSG_ZEROCOPY sends before this id completed */
+    uint32_t zc_copied;      /* # completions where the kernel copied anyway */
+    struct sock_connecting *connecting; /* async connect in progress */
+    struct rbuf *rbuf;       /* inbound buffer embedded by the pool, or NULL */
+    struct rbuf *wbuf;       /* outbound buffer embedded by the pool, or NULL */
+    struct sock_conn_pool *pool;  /* owner, NULL if from sock_conn_create */
+    struct sock_conn *free_next;  /* free list link while in the pool */
+};
+
+/*
+ * slab pool of sock_conn for one thread (e.g. a reactor): objects are carved
+ * from cache line aligned slabs, each may embed an rbuf and a wbuf right
+ * after the sock_conn, and sock_conn_destroy puts them back on a free list
+ */
+struct sock_conn_pool {
+    struct sock_conn *free;  /* free list, most recently freed first */
+    uint32_t nfree;          /* # free objects */
+    uint32_t nused;          /* # objects handed out */
+    uint32_t nslab_obj;      /* # objects per slab */
+    uint32_t max_obj;        /* max # objects, 0 if unbounded */
+    size_t   obj_size;       /* size of an object, cache line aligned */
+    uint32_t rbuf_cap;       /* capacity of the embedded rbuf, 0 if none */
+    uint32_t wbuf_cap;       /* capacity of the embedded wbuf, 0 if none */
+    void     **slabs;        /* slabs[] - for destroy */
+    uint32_t nslab;          /* # slabs */
+    bool     is_destroy;     /* destroyed, freed when the last object is back */
+};
+
+/* async connect result, err is 0, ETIMEDOUT or the errno of the connect */
+typedef void (*sock_connect_fn)(struct sock_conn *, int err, void *arg);
+
+/* pipe relaying one direction of a splice proxy, data may wait in it */
+struct sock_relay {
+    int      pipe[2];
+    size_t   npipe;          /* bytes buffered in the pipe */
+};
+
+#define SOCK_METRIC(ACTION)                                                       \
+    ACTION( sock_accept,        METRIC_COUNTER, "# connections accepted"         )\
+    ACTION( sock_accept_batch,  METRIC_COUNTER, "# accept batches"               )\
+    ACTION( sock_accept_full,   METRIC_COUNTER, "# accept batches that hit the limit")\
+    ACTION( sock_accept_ex,     METRIC_COUNTER, "# accept errors"                )\
+    ACTION( sock_accept_last,   METRIC_GAUGE,   "# accepted by the last batch"   )
+
+struct sock_metrics {
+    SOCK_METRIC(METRIC_DECLARE)
+};
+
+/* count socket activity into m, NULL stops counting */
+void
+sock_metrics_setup(struct sock_metrics *m);
+
+/*
+ * socket tuning applied in one call, 0 (-1 for incoming_cpu) keeps the
+ * kernel default. the listener options are inherited by accepted sockets,
+ * so sock_profile_accepted only sets what the kernel does not copy
+ *
+ * nodelay       - TCP_NODELAY
+ * quickack      - TCP_QUICKACK, not inherited and reset by the kernel
+ * notsent_lowat - TCP_NOTSENT_LOWAT, bytes unsent before EPOLLOUT clears
+ * busy_poll     - SO_BUSY_POLL us
+ * incoming_cpu  - SO_INCOMING_CPU, on a SO_REUSEPORT listener it steers
+ *                 connections to the listener of the cpu handling the flow
+ * sndbuf/rcvbuf - SO_SNDBUF/SO_RCVBUF bytes
+ * fastopen      - TCP_FASTOPEN queue on listeners, TCP_FASTOPEN_CONNECT on
+ *                 connects if non-zero
+ * defer_accept  - TCP_DEFER_ACCEPT s, listeners wake up with data only
+ * reuseport     - SO_REUSEPORT, listeners
+ */
+struct sock_profile {
+    bool     nodelay;
+    bool     quickack;
+    int      notsent_lowat;
+    int      busy_poll;
+    int      incoming_cpu;
+    int      sndbuf;
+    int      rcvbuf;
+    int      fastopen;
+    int      defer_accept;
+    bool     reuseport;
+};
+
+#define SOCK_PROFILE_INIT   { .incoming_cpu = -1 }
+
+/* latency tier: no batching delays, small unsent queue, busy polling */
+extern const struct sock_profile sock_profile_latency;
+
+/* throughput tier: large buffers, fewer wakeups per byte */
+extern const struct sock_profile sock_profile_throughput;
+
+/* one resolved address, owns its sockaddr so it can be copied and cached */
+struct sock_addr {
+    int                     family;
+    int                     socktype;
+    int                     protocol;
+    socklen_t               addrlen;
+    struct sockaddr_storage addr;
+};
+
+/* fill ai to refer to sa, ai is valid as long as sa is */
+static inline void
+sock_addr_info(struct sock_addr *sa, struct addrinfo *ai)
+{
+    memset(ai, 0, sizeof(*ai));
+    ai->ai_family = sa->family;
+    ai->ai_socktype = sa->socktype;
+    ai->ai_protocol = sa->protocol;
+    ai->ai_addrlen = sa->addrlen;
+    ai->ai_addr = (struct sockaddr *)&sa->addr;
+}
+
+/*
+ * one datagram of a batch: buf of size bytes is preallocated by the caller,
+ * len is the # bytes received or to send. with UDP_GRO on, a received buf
+ * may hold several datagrams of segsz bytes each (the last may be shorter)
+ */
+struct sock_dgram {
+    void                    *buf;
+    size_t                  size;
+    size_t                  len;
+    struct sockaddr_storage addr;   /* source, or destination if addrlen > 0 */
+    socklen_t               addrlen;
+    uint16_t                segsz;  /* GRO segment size, 0 if not coalesced */
 };
 
 static inline int
@@ -44,12 +190,42 @@ sock_set_nonblocking(int sd);
 int
 sock_set_reuseaddr(int sd);
 
+int
+sock_set_reuseport(int sd);
+
 int
 sock_set_tcpnodelay(int sd);
 
 int
 sock_set_linger(int sd, int timeout);
 
+int
+sock_set_busy_poll(int sd, int usec);
+
+/* profile of a listening socket, before bind (reuseport) and listen */
+int
+sock_profile_listen(int sd, const struct sock_profile *p);
+
+/* profile of an accepted socket, only what it did not inherit */
+int
+sock_profile_accepted(int sd, const struct sock_profile *p);
+
+/* profile of an outbound socket, before connect */
+int
+sock_profile_connect(int sd, const struct sock_profile *p);
+
+/* allow MSG_ZEROCOPY sends on sd */
+int
+sock_set_zerocopy(int sd);
+
+/* UDP GSO: one send of up to 64KB is split by the kernel into size datagrams */
+int
+sock_set_udp_segment(int sd, int size);
+
+/* UDP GRO: consecutive datagrams of a flow are received as one buffer */
+int
+sock_set_udp_gro(int sd, bool is_on);
+
 int
 sock_set_sndbuf(int sd, int size);
 
@@ -71,14 +247,105 @@ sock_recv(struct sock_conn *c, void *buf, size_t nbyte);
 int
 sock_send(struct sock_conn *c, void *buf, size_t nbyte);
 
+/* readv into iov, at most SOCK_IOV_MAX buffers are filled per call */
+int
+sock_recvv(struct sock_conn *c, struct iovec *iov, int iovcnt);
+
+/*
+ * writev iov until it is sent or the socket is full, returns the bytes sent,
+ * at most INT_MAX per call. iov is advanced in place past what was sent, so
+ * after CMN_EAGAIN or a short count the same array can be passed again once
+ * the socket is writable
+ */
+int
+sock_sendv(struct sock_conn *c, struct iovec *iov, int iovcnt);
+
+/*
+ * send nbyte of fd from *offset with sendfile, *offset is advanced; returns
+ * the bytes sent (at most INT_MAX per call), CMN_EAGAIN or CMN_ERROR, 0 at
+ * the end of the file
+ */
+int
+sock_sendfile(struct sock_conn *c, int fd, off_t *offset, size_t nbyte);
+
+int
+sock_relay_init(struct sock_relay *r);
+
+void
+sock_relay_deinit(struct sock_relay *r);
+
+/*
+ * move up to nbyte (at most INT_MAX) from src to dst through the pipe of r
+ * with splice, the payload never enters user space. returns the bytes written to dst (what
+ * dst could not take stays in r), 0 on eof of src with an empty pipe,
+ * CMN_EAGAIN or CMN_ERROR
+ */
+int
+sock_splice(struct sock_relay *r, struct sock_conn *src, struct sock_conn *dst,
+            size_t nbyte);
+
+/*
+ * send buf with MSG_ZEROCOPY (see sock_set_zerocopy), buf is pinned until
+ * the send completes: each call that sends bytes gets the id c->zc_next - 1,
+ * and buf may be reused once sock_zc_reap moves c->zc_done past it. small
+ * sends are cheaper copied, use it for buffers of ~10KB and up
+ */
+int
+sock_send_zc(struct sock_conn *c, void *buf, size_t nbyte);
+
+/*
+ * read zerocopy completions off the error queue, call it when the event
+ * loop reports EVENT_ERR on c; returns the # sends completed or CMN_ERROR
+ */
+int
+sock_zc_reap(struct sock_conn *c);
+
+/*
+ * queue buf for the next sock_flush without copying it, buf must stay valid
+ * until sock_pending drops to zero. queue everything produced in one loop
+ * iteration and flush once, so pipelined replies cost a single writev
+ */
+int
+sock_queue(struct sock_conn *c, void *buf, size_t nbyte);
+
+/* send the queued output, returns the bytes sent, CMN_EAGAIN or CMN_ERROR */
+int
+sock_flush(struct sock_conn *c);
+
+static inline size_t
+sock_pending(struct sock_conn *c)
+{
+    return c->oq_nbyte;
+}
+
 struct sock_conn *
 sock_conn_create(bool is_listen, void *data);
 
 void
 sock_conn_destroy(struct sock_conn **conn);
 
+/*
+ * pool of up to max_obj (0 for no bound) connections, nprealloc of them are
+ * carved up front; rbuf_cap and wbuf_cap size the embedded buffers
+ */
+struct sock_conn_pool *
+sock_conn_pool_create(uint32_t nprealloc, uint32_t max_obj, uint32_t rbuf_cap,
+                      uint32_t wbuf_cap);
+
+/* connections still out keep the pool alive until they are destroyed */
+void
+sock_conn_pool_destroy(struct sock_conn_pool **pool);
+
+/* like sock_conn_create, but from pool; give it back with sock_conn_destroy */
+struct sock_conn *
+sock_conn_pool_get(struct sock_conn_pool *pool, bool is_listen, void *data);
+
+/*
+ * resolve name (NULL for the wildcard address) and port with a blocking
+ * getaddrinfo, see cmn_resolve.h for the cached and asynchronous variants
+ */
 int
-sock_resolve(char *name, int port, struct addrinfo *si, bool is_ipv4);
+sock_resolve(const char *name, int port, struct sock_addr *sa, bool is_ipv4);
 
 int
 nc_unresolve(struct addrinfo *si, char *buf, int buf_size);
@@ -86,15 +353,102 @@ nc_unresolve(struct addrinfo *si, char *buf, int buf_size);
 bool
 sock_connect(struct addrinfo *ai, struct sock_conn *c);
 
+/*
+ * start a nonblocking connect of c to ai and return at once, cb runs on the
+ * loop of evb when the connect completes, fails or is not done within
+ * timeout ms (-1 for none). c->sd is watched for writability until then and
+ * is unregistered from evb again before cb runs; on failure it is closed.
+ * ai must be filled for a stream socket, p may be NULL
+ */
+int
+sock_connect_async(struct event_base *evb, struct addrinfo *ai, struct sock_conn *c,
+                   const struct sock_profile *p, int64_t timeout, sock_connect_fn cb,
+                   void *arg);
+
+/* abort an async connect, closes c->sd and drops its callback */
+void
+sock_connect_cancel(struct sock_conn *c);
+
 bool
 sock_listen(struct addrinfo *ai, struct sock_conn *c, int max_backlog);
 
+/* listen with SO_REUSEPORT, so every caller gets its own accept queue */
+bool
+sock_listen_reuseport(struct addrinfo *ai, struct sock_conn *c, int max_backlog);
+
+/* listen with the options of profile p */
+bool
+sock_listen_profile(struct addrinfo *ai, struct sock_conn *c, int max_backlog,
+                    const struct sock_profile *p);
+
+/* nonblocking UDP socket bound to ai, is_reuseport shards it across sockets */
+bool
+sock_udp_bind(struct addrinfo *ai, struct sock_conn *c, bool is_reuseport);
+
+/* nonblocking UDP socket connected to ai, sends may then leave addrlen 0 */
+bool
+sock_udp_connect(struct addrinfo *ai, struct sock_conn *c);
+
+/*
+ * receive up to n datagrams with one recvmmsg, returns the # received,
+ * CMN_EAGAIN or CMN_ERROR; at most SOCK_MAX_BATCH per call
+ */
+int
+sock_recv_batch(struct sock_conn *c, struct sock_dgram *d, int n);
+
+/*
+ * send n datagrams with as few sendmmsg as possible, returns the # sent,
+ * which is short when the socket buffer fills, CMN_EAGAIN or CMN_ERROR
+ */
+int
+sock_send_batch(struct sock_conn *c, struct sock_dgram *d, int n);
+
+/*
+ * unix domain sockets of type SOCK_STREAM or SOCK_SEQPACKET, a path starting
+ * with '@' is in the abstract namespace and needs no file. a stale socket
+ * file at path is replaced, one still served by a listener fails with
+ * EADDRINUSE in c->err. sock_accept_batch accepts on the listener
+ */
+bool
+sock_unix_listen(const char *path, int type, struct sock_conn *c, int max_backlog);
+
+/* nonblocking, fails with c->err EAGAIN when the backlog of path is full */
+bool
+sock_unix_connect(const char *path, int type, struct sock_conn *c);
+
+/*
+ * send nbyte (at least one) of buf with nfd descriptors attached, the
+ * receiver gets duplicates that stay valid after the sender closes its own.
+ * returns the bytes sent, CMN_EAGAIN or CMN_ERROR; the descriptors go with
+ * the first byte, so a short send need not resend them
+ */
+int
+sock_send_fds(struct sock_conn *c, void *buf, size_t nbyte, const int *fd, int nfd);
+
+/*
+ * receive into buf and up to *nfd descriptors into fd (close-on-exec),
+ * *nfd is set to the # received; descriptors beyond *nfd are lost
+ */
+int
+sock_recv_fds(struct sock_conn *c, void *buf, size_t nbyte, int *fd, int *nfd);
+
 void
 sock_close(struct sock_conn *c);
 
 bool
 sock_accept(struct sock_conn *sc, struct sock_conn *c);
 
+/*
+ * accept up to n pending connections of listener sc into sd[], returns the
+ * # accepted, fewer than n means the backlog is drained. the sockets are
+ * nonblocking and close-on-exec from accept4 and inherit the rest of their
+ * options from the listener, so no further syscall is made per connection.
+ * out of descriptors, a pending connection is accepted and closed on a
+ * reserve descriptor so the listener does not stay readable
+ */
+int
+sock_accept_batch(struct sock_conn *sc, int *sd, int n);
+
 void
 sock_reject_all(struct sock_conn *sc);
 
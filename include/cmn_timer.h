@@ -0,0 +1,76 @@
+#ifndef __CMN_TIMER_H
+#define __CMN_TIMER_H
+
+#include "cmn_base.h"
+#include "cmn_queue.h"
+
+/*
+ * hierarchical timer wheel with a resolution of one millisecond
+ *
+ * level 0 has TW_ROOT_SIZE slots of one tick, every upper level has
+ * TW_LEVEL_SIZE slots each spanning a whole lower level. add, cancel and
+ * reset are O(1); a timer is cascaded at most once per level on its way
+ * down to level 0.
+ */
+#define TW_ROOT_BITS    8
+#define TW_LEVEL_BITS   6
+#define TW_ROOT_SIZE    (1 << TW_ROOT_BITS)
+#define TW_LEVEL_SIZE   (1 << TW_LEVEL_BITS)
+#define TW_ROOT_MASK    (TW_ROOT_SIZE - 1)
+#define TW_LEVEL_MASK   (TW_LEVEL_SIZE - 1)
+#define TW_NLEVEL       4   /* # upper levels */
+
+/* longest timeout, about 49 days */
+#define TW_MAX_TIMEOUT  ((1LL << (TW_ROOT_BITS + TW_NLEVEL * TW_LEVEL_BITS)) - 1)
+
+typedef void (*timer_cb_fn)(void *);  /* timer callback */
+
+struct timer;
+TAILQ_HEAD(timer_list, timer);
+
+struct timer {
+    TAILQ_ENTRY(timer) link;     /* slot link */
+    struct timer_list  *slot;    /* slot holding the timer, NULL if idle */
+    int64_t            expire;   /* expire time in ms */
+    timer_cb_fn        cb;       /* timer callback */
+    void               *arg;     /* argument of the callback */
+};
+
+struct timer_wheel {
+    int64_t            now;      /* next tick to be processed */
+    uint32_t           ntimer;   /* # pending timers */
+    struct timer_list  root[TW_ROOT_SIZE];
+    struct timer_list  level[TW_NLEVEL][TW_LEVEL_SIZE];
+};
+
+static inline void
+timer_init(struct timer *t, timer_cb_fn cb, void *arg)
+{
+    t->slot = NULL;
+    t->expire = 0;
+    t->cb = cb;
+    t->arg = arg;
+}
+
+static inline bool
+timer_pending(const struct timer *t)
+{
+    return t->slot != NULL;
+}
+
+struct timer_wheel *timer_wheel_create(void);
+void timer_wheel_destroy(struct timer_wheel **tw);
+
+/* (re)schedule t to fire after timeout ms */
+void timer_wheel_add(struct timer_wheel *tw, struct timer *t, int64_t timeout);
+
+/* cancel t, no-op if it is not pending */
+void timer_wheel_del(struct timer_wheel *tw, struct timer *t);
+
+/* ms until the nearest deadline (a lower bound), -1 if no timer is pending */
+int timer_wheel_timeout(struct timer_wheel *tw);
+
+/* fire every timer expired by now, returns # fired */
+int timer_wheel_expire(struct timer_wheel *tw);
+
+#endif
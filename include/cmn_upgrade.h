@@ -0,0 +1,94 @@
+#ifndef __CMN_UPGRADE_H
+#define __CMN_UPGRADE_H
+
+#include "cmn_base.h"
+#include "cmn_log.h"
+#include "cmn_event.h"
+#include "cmn_sock.h"
+
+/*
+ * hot restart: hand the listening sockets and shared memory of a running
+ * process to its replacement
+ *
+ * the running process serves path with upgrade_create. the new binary calls
+ * upgrade_takeover at startup and gets the descriptors and shm ids by name,
+ * so the listen backlog is never closed and sms segments are attached warm
+ * (shm_attch on the received sid instead of shm_create). once it accepts,
+ * upgrade_ready tells the old process to drain: it stops accepting, finishes
+ * its connections and exits. the new process then rewrites the pid file and
+ * serves path itself. a new process that exits, or does not call
+ * upgrade_ready within the timeout of upgrade_create, aborts the upgrade
+ * and the old one keeps serving.
+ */
+
+#define UPGRADE_MAX_FD      SOCK_MAX_FDS    /* max # descriptors handed off */
+#define UPGRADE_MAX_SHM     16              /* max # shm segments handed off */
+#define UPGRADE_NAME_LEN    32              /* max length of a name, with nul */
+
+/* what is handed off, and on the new side the link to the old process */
+struct upgrade_state {
+    int     nfd;
+    int     fd[UPGRADE_MAX_FD];
+    char    fd_name[UPGRADE_MAX_FD][UPGRADE_NAME_LEN];
+    int     nshm;
+    int     shm_id[UPGRADE_MAX_SHM];
+    char    shm_name[UPGRADE_MAX_SHM][UPGRADE_NAME_LEN];
+    pid_t   pid;    /* old process */
+    int     sd;     /* link to the old process until upgrade_ready */
+};
+
+/* the new process is ready, stop accepting and drain */
+typedef void (*upgrade_fn)(void *arg);
+
+struct upgrade {
+    struct event_base    *evb;
+    char                 path[MAX_FILENAME_LEN];
+    struct sock_conn     l;     /* waits for the new process */
+    struct sock_conn     c;     /* new process, sd -1 if none */
+    struct upgrade_state st;    /* handed to the new process */
+    int64_t              timeout;   /* ms the new process has to get ready */
+    struct timer         timer;     /* aborts a hand-off past timeout */
+    upgrade_fn           cb;
+    void                 *arg;
+};
+
+/*
+ * old side, serve path (a unix socket, '@' for abstract) in the loop of evb;
+ * a new process not ready within timeout ms of the hand-off (-1 for no
+ * limit) is given up on and the old one keeps serving
+ */
+struct upgrade *
+upgrade_create(struct event_base *evb, const char *path, int64_t timeout,
+               upgrade_fn cb, void *arg);
+
+void
+upgrade_destroy(struct upgrade **u);
+
+/* hand off fd under name, fd stays owned by the caller */
+int
+upgrade_add_fd(struct upgrade *u, const char *name, int fd);
+
+/* hand off the shm segment sid under name */
+int
+upgrade_add_shm(struct upgrade *u, const char *name, int sid);
+
+/*
+ * new side, take over from the process serving path, waiting up to timeout
+ * ms (-1 for no limit) for its state. returns CMN_NOKEY when no process
+ * serves path, i.e. on a cold start
+ */
+int
+upgrade_takeover(const char *path, int64_t timeout, struct upgrade_state *st);
+
+/* descriptor or shm id handed off under name, -1 if none */
+int
+upgrade_fd(const struct upgrade_state *st, const char *name);
+
+int
+upgrade_shm(const struct upgrade_state *st, const char *name);
+
+/* tell the old process to drain and close the link to it */
+int
+upgrade_ready(struct upgrade_state *st);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef __CMN_URING_H
+#define __CMN_URING_H
+
+#include "cmn_base.h"
+#include <linux/io_uring.h>
+
+/*
+ * minimal io_uring wrapper without liburing
+ *
+ * sqes are filled by uring_get_sqe and handed to the kernel by the next
+ * uring_enter, so any number of submissions costs one syscall. only kernels
+ * with IORING_FEAT_EXT_ARG (5.11) and IORING_FEAT_NODROP are accepted, older
+ * ones make uring_init fail with ENOSYS.
+ */
+struct uring {
+    int                 fd;           /* ring descriptor */
+    unsigned            features;     /* IORING_FEAT_* */
+
+    unsigned            sq_entries;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned            sqe_head;     /* sqes handed to the kernel */
+    unsigned            sqe_tail;     /* sqes filled */
+
+    unsigned            cq_entries;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void                *sq_ring;
+    size_t              sq_ring_size;
+    void                *cq_ring;
+    size_t              cq_ring_size;
+    size_t              sqes_size;
+};
+
+int uring_init(struct uring *ur, unsigned entries);
+void uring_exit(struct uring *ur);
+
+/* next free sqe, zeroed; submits the pending ones if the ring is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *ur);
+
+/*
+ * submit pending sqes and wait up to timeout ms (-1 forever) for min_complete
+ * completions, returns # submitted or CMN_ERROR with errno set
+ */
+int uring_enter(struct uring *ur, unsigned min_complete, int timeout);
+
+static inline unsigned
+uring_cq_ready(struct uring *ur)
+{
+    return __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE) - *ur->cq_head;
+}
+
+static inline struct io_uring_cqe *
+uring_peek_cqe(struct uring *ur)
+{
+    unsigned head = *ur->cq_head;
+
+    if (head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ur->cqes[head & *ur->cq_mask];
+}
+
+static inline void
+uring_cqe_seen(struct uring *ur)
+{
+    __atomic_store_n(ur->cq_head, *ur->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif